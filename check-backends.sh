@@ -0,0 +1,356 @@
+#!/bin/sh
+# Runs every input through every I/O path m4mudex has, and checks that
+# the results agree. The plain file-to-file path (output_tree, with the
+# small file path turned off) is the reference: the paths that should produce the same bytes are compared
+# against it with cmp, and every output is checked with m4mudex -V,
+# which makes sure it's well formed and carries the same media data as
+# the input.
+#
+# The corpus is test.m4a plus synthetic files from m4mugen. Synthetic
+# files whose names start with "late-" have meta boxes after the media
+# data. The streaming paths strip those that come after the last mdat,
+# except for tar, which has already written the member size by then.
+# Where a path can only blank them, its output is checked with -V but
+# not compared byte for byte. The qt-* files are
+# QuickTime movies, with their metadata in udta text atoms as well as
+# meta boxes.
+#
+# The http backend fetches the stripped view from m4mudex -S in two
+# ranged requests, so it needs curl; it's skipped without it.
+
+M=./m4mudex
+G=./m4mugen
+DIR=check.tmp
+failures=0
+
+rm -rf $DIR
+mkdir -p $DIR/corpus
+
+cp test.m4a $DIR/corpus/test.m4a
+$G -l ftyp,moov,free,mdat $DIR/corpus/moov-first.m4a
+$G -l ftyp,meta,moov,mdat -t 2 $DIR/corpus/top-meta.m4a
+$G -l ftyp,moov,mdat -M $DIR/corpus/no-meta.m4a
+$G -l ftyp,moov,free,mdat -t 3 -n 5000 $DIR/corpus/three-track.m4a
+$G -l ftyp,moov,mdat,mdat -6 -L -t 2 $DIR/corpus/co64.m4a
+$G -l ftyp,free,mdat,moov -t 2 $DIR/corpus/late-moov-last.m4a
+$G -l ftyp,moov,mdat,meta,mdat,meta,mdat -t 2 $DIR/corpus/late-split-mdat.m4a
+$G -Q -Z -t 2 -l ftyp,moov,wide,mdat $DIR/corpus/qt-size-to-end.m4a
+$G -Q -t 2 -l ftyp,wide,mdat,moov $DIR/corpus/late-qt-moov-last.m4a
+
+# Each backend reads $in and writes $out. The streaming ones are
+# marked so late-* inputs with meta boxes between mdats skip the byte
+# comparison.
+backends="tree small pipe stdout splice tee tar inplace"
+streaming="pipe stdout splice tee tar"
+
+server=
+if command -v curl > /dev/null; then
+    port=$((20000 + $$ % 10000))
+    $M -S $port $DIR/corpus > $DIR/server.log 2>&1 &
+    server=$!
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        grep -q Serving $DIR/server.log && break
+        sleep 0.1
+    done
+    backends="$backends http"
+fi
+
+run() {
+    case $1 in
+    tree)    $M --small-file-max 0 "$in" "$out" > /dev/null ;;
+    small)   $M "$in" "$out" > /dev/null ;;
+    pipe)    cat "$in" | $M - - > "$out" 2> /dev/null ;;
+    stdout)  $M "$in" - > "$out" 2> /dev/null ;;
+    splice)  { $M "$in" - 2> /dev/null; echo $? > $DIR/status; } | cat > "$out" &&
+             [ `cat $DIR/status` = 0 ] ;;
+    tee)     $M -c $DIR/copy -s $DIR/sidecar "$in" "$out" > /dev/null &&
+             cmp -s "$in" $DIR/copy ;;
+    tar)     rm -rf $DIR/tar && mkdir -p $DIR/tar &&
+             cp "$in" $DIR/tar/member.m4a &&
+             tar -cf $DIR/in.tar -C $DIR/tar member.m4a &&
+             $M -t $DIR/in.tar $DIR/out.tar > /dev/null &&
+             tar -xOf $DIR/out.tar member.m4a > "$out" ;;
+    inplace) cp "$in" "$out" && $M -i "$out" > /dev/null ;;
+    http)    url=http://127.0.0.1:$port/`basename "$in"` &&
+             curl -sf -r 0-999 "$url" > "$out" &&
+             curl -sf -r 1000- "$url" >> "$out" ;;
+    esac
+}
+
+for in in $DIR/corpus/*.m4a; do
+    name=`basename $in .m4a`
+    ref=$DIR/$name.tree
+    for backend in $backends; do
+        out=$DIR/$name.$backend
+        if ! run $backend; then
+            echo "FAIL $name $backend: exited with an error"
+            failures=$((failures + 1))
+            continue
+        fi
+        if ! $M -V "$in" "$out" > $DIR/verify.log; then
+            echo "FAIL $name $backend: output doesn't verify"
+            cat $DIR/verify.log
+            failures=$((failures + 1))
+            continue
+        fi
+        exact=yes
+        [ $backend = inplace ] && exact=no
+        case "$name" in
+        late-split-*)
+            case " $streaming " in *" $backend "*) exact=no ;; esac ;;
+        late-*)
+            [ $backend = tar ] && exact=no ;;
+        esac
+        if [ $exact = yes ] && ! cmp -s "$ref" "$out"; then
+            echo "FAIL $name $backend: output differs from the tree path"
+            failures=$((failures + 1))
+            continue
+        fi
+        echo "ok   $name $backend"
+    done
+done
+
+# Dropping tracks and aligning the media data are only done file to
+# file. The result has to verify with the same tracks left out of the
+# original.
+rewrite() {
+    name=$1
+    drop=$2
+    shift 2
+    in=$DIR/corpus/$name.m4a
+    out=$DIR/$name.rewrite
+    if ! $M $drop "$@" "$in" "$out" > /dev/null ||
+       ! $M $drop -V "$in" "$out" > $DIR/verify.log; then
+        echo "FAIL $name" $drop $*
+        cat $DIR/verify.log
+        failures=$((failures + 1))
+        return
+    fi
+    echo "ok   $name" $drop $*
+}
+
+rewrite three-track "-d 2"
+rewrite co64 "-d 1"
+rewrite late-split-mdat "-d 2"
+rewrite top-meta "-d soun"
+rewrite test "" -a 4096
+rewrite three-track "" -a 4096 -A
+rewrite co64 "" -A
+rewrite late-split-mdat "-d 1" -a 65536 -A
+
+# Indexing a fragmented file puts a sidx ahead of the fragments, moving
+# all of them, and an mfra at the end. The result has to verify, and
+# indexing it again has to replace both with the same thing.
+$G -F -t 2 -n 500 $DIR/fragmented.mp4
+if ! $M --sidx --mfra $DIR/fragmented.mp4 $DIR/indexed.mp4 > /dev/null ||
+   ! $M -V $DIR/fragmented.mp4 $DIR/indexed.mp4 > $DIR/verify.log ||
+   [ `$M diff $DIR/fragmented.mp4 $DIR/indexed.mp4 | grep -c '^+ sidx\|^+ mfra'` -ne 2 ] ||
+   ! $M --sidx --mfra -a 4096 $DIR/indexed.mp4 $DIR/reindexed.mp4 > /dev/null ||
+   ! $M -V $DIR/fragmented.mp4 $DIR/reindexed.mp4 > $DIR/verify.log ||
+   ! $M --sidx --mfra $DIR/indexed.mp4 $DIR/reindexed.mp4 > /dev/null ||
+   ! cmp -s $DIR/indexed.mp4 $DIR/reindexed.mp4; then
+    echo "FAIL fragmented --sidx --mfra"
+    cat $DIR/verify.log
+    failures=$((failures + 1))
+else
+    echo "ok   fragmented --sidx --mfra"
+fi
+
+# diff has to find a file identical to itself, and the tree path's
+# output different from its input only in its boxes, not its media.
+for in in $DIR/corpus/*.m4a; do
+    name=`basename $in .m4a`
+    $M diff "$in" "$in" > /dev/null
+    same=$?
+    $M diff "$in" $DIR/$name.tree > $DIR/diff.log
+    stripped=$?
+    if [ $same -ne 0 ] || [ $stripped -gt 1 ]; then
+        echo "FAIL $name diff"
+        cat $DIR/diff.log
+        failures=$((failures + 1))
+        continue
+    fi
+    echo "ok   $name diff"
+done
+
+# batch has to write the same files as stripping them one at a time,
+# passing on the options after --.
+mkdir -p $DIR/batch
+if ! $M batch -j 2 $DIR/batch $DIR/corpus/*.m4a -- --small-file-max 0 > $DIR/batch.log; then
+    echo "FAIL batch"
+    cat $DIR/batch.log
+    failures=$((failures + 1))
+fi
+for in in $DIR/corpus/*.m4a; do
+    name=`basename $in .m4a`
+    if ! cmp -s $DIR/$name.tree $DIR/batch/$name.m4a; then
+        echo "FAIL $name batch"
+        failures=$((failures + 1))
+        continue
+    fi
+    echo "ok   $name batch"
+done
+
+# With a cache, the second run of an input has to hand out the first
+# one's result, and a run with different options mustn't. Writing a
+# different result over one that was fetched, with or without --cache,
+# mustn't change what's cached.
+mkdir -p $DIR/cache
+a=$DIR/corpus/three-track.m4a
+b=$DIR/corpus/top-meta.m4a
+if ! $M --cache $DIR/cache "$a" $DIR/cached.m4a > /dev/null ||
+   ! $M --cache $DIR/cache "$b" $DIR/cached.m4a > /dev/null ||
+   ! cmp -s $DIR/top-meta.tree $DIR/cached.m4a ||
+   ! $M --cache $DIR/cache "$a" $DIR/cached2.m4a | grep -q '^Found in the cache' ||
+   ! cmp -s $DIR/three-track.tree $DIR/cached2.m4a ||
+   $M --cache $DIR/cache -A "$a" $DIR/cached2.m4a | grep -q '^Found in the cache' ||
+   ! $M -V "$a" $DIR/cached2.m4a > /dev/null ||
+   ! $M --cache $DIR/cache "$b" $DIR/cached2.m4a | grep -q '^Found in the cache' ||
+   ! $M --cache $DIR/cache "$a" $DIR/cached3.m4a | grep -q '^Found in the cache' ||
+   ! cmp -s $DIR/three-track.tree $DIR/cached3.m4a ||
+   ! cmp -s $DIR/top-meta.tree $DIR/cached2.m4a ||
+   ! $M "$b" $DIR/cached3.m4a > /dev/null ||
+   ! $M --cache $DIR/cache "$a" $DIR/cached4.m4a | grep -q '^Found in the cache' ||
+   ! cmp -s $DIR/three-track.tree $DIR/cached4.m4a; then
+    echo "FAIL cache"
+    failures=$((failures + 1))
+else
+    echo "ok   cache"
+fi
+
+# A run stuck reading a pipe that never delivers has to give up at its
+# deadline, with its own exit status, and leave no output behind.
+(printf 'xx'; sleep 3) | $M --deadline 0.2 - $DIR/stuck.out 2> /dev/null
+status=$?
+if [ $status -ne 124 ] || [ -e $DIR/stuck.out ]; then
+    echo "FAIL deadline: exited with $status"
+    failures=$((failures + 1))
+else
+    echo "ok   deadline"
+fi
+
+# The Merkle root covers the chunks' contents, not where they are, so
+# it has to survive realignment.
+for in in $DIR/corpus/*.m4a; do
+    name=`basename $in .m4a`
+    if ! $M -m $DIR/plain.merkle "$in" $DIR/plain.out > /dev/null ||
+       ! $M -m $DIR/aligned.merkle -A "$in" $DIR/aligned.out > /dev/null ||
+       [ "`grep '^root' $DIR/plain.merkle`" != "`grep '^root' $DIR/aligned.merkle`" ]; then
+        echo "FAIL $name merkle"
+        failures=$((failures + 1))
+        continue
+    fi
+    echo "ok   $name merkle"
+done
+
+# probe and analyze have to describe every track of every file in the
+# corpus.
+for in in $DIR/corpus/*.m4a; do
+    name=`basename $in .m4a`
+    if ! $M probe "$in" > $DIR/probe.json || ! grep -q '"codec_string":"mp4a.40.2"' $DIR/probe.json; then
+        echo "FAIL $name probe"
+        cat $DIR/probe.json
+        failures=$((failures + 1))
+        continue
+    fi
+    echo "ok   $name probe"
+done
+
+for in in $DIR/corpus/*.m4a; do
+    name=`basename $in .m4a`
+    if ! $M analyze "$in" > $DIR/analyze.json || ! grep -q '"bitrate_curve":\[[0-9]' $DIR/analyze.json; then
+        echo "FAIL $name analyze"
+        cat $DIR/analyze.json
+        failures=$((failures + 1))
+        continue
+    fi
+    echo "ok   $name analyze"
+done
+
+# File names go into the JSON as they are if they're UTF-8, and with
+# U+FFFD for the bytes that aren't.
+utf8=`printf 'Bj\303\266rk \342\200\223 J\303\263ga'`
+latin1=`printf 'Bj\366rk'`
+cp test.m4a "$DIR/$utf8.m4a"
+cp test.m4a "$DIR/$latin1.m4a"
+if ! $M probe "$DIR/$utf8.m4a" | grep -q "^{\"file\":\"$DIR/$utf8.m4a\"" ||
+   ! $M analyze "$DIR/$utf8.m4a" | grep -q "^{\"file\":\"$DIR/$utf8.m4a\"" ||
+   ! $M probe "$DIR/$latin1.m4a" | grep -q '^{"file":"[^"]*/Bj\\ufffdrk.m4a"'; then
+    echo "FAIL probe UTF-8 names"
+    failures=$((failures + 1))
+else
+    echo "ok   probe UTF-8 names"
+fi
+
+# export-es has to give every sample of the first track an ADTS header,
+# and find the same stream in the stripped file.
+for in in $DIR/corpus/*.m4a; do
+    name=`basename $in .m4a`
+    set -- `$M probe "$in" | sed 's/},{.*//; s/.*"samples":\([0-9]*\),"bytes":\([0-9]*\).*/\1 \2/'`
+    if ! $M export-es "$in" $DIR/orig.aac || ! $M export-es $DIR/$name.tree - > $DIR/tree.aac ||
+       ! cmp -s $DIR/orig.aac $DIR/tree.aac ||
+       [ `wc -c < $DIR/orig.aac` -ne $(($2 + 7 * $1)) ] ||
+       [ "`od -An -tx1 -N2 $DIR/orig.aac`" != " ff f1" ]; then
+        echo "FAIL $name export-es"
+        failures=$((failures + 1))
+        continue
+    fi
+    echo "ok   $name export-es"
+
+    # Muxing the stream back into an .m4a has to give the same stream
+    # on export, and leave nothing for a strip to remove. A file, which
+    # is mapped, has to give the same result as a pipe.
+    if ! cat $DIR/orig.aac | $M mux-adts - $DIR/muxed.m4a ||
+       ! $M mux-adts $DIR/orig.aac $DIR/muxed-file.m4a ||
+       ! cmp -s $DIR/muxed.m4a $DIR/muxed-file.m4a ||
+       ! $M export-es $DIR/muxed.m4a - | cmp -s - $DIR/orig.aac ||
+       ! $M $DIR/muxed.m4a $DIR/muxed.out > /dev/null ||
+       ! cmp -s $DIR/muxed.m4a $DIR/muxed.out; then
+        echo "FAIL $name mux-adts"
+        failures=$((failures + 1))
+        continue
+    fi
+    echo "ok   $name mux-adts"
+done
+
+# An H.264 track has to come out in Annex B form: SPS and PPS ahead of
+# every sync sample, a start code ahead of every NAL unit, and the NAL
+# units untouched. m4mugen writes the stream it should be.
+$G -v -t 2 -n 500 -H $DIR/video.expected $DIR/video.mp4
+if ! $M export-es -t vide $DIR/video.mp4 $DIR/video.h264 ||
+   ! cmp -s $DIR/video.h264 $DIR/video.expected ||
+   [ "`od -An -tx1 -N5 $DIR/video.h264`" != " 00 00 00 01 67" ] ||
+   ! $M $DIR/video.mp4 $DIR/video.out > /dev/null ||
+   ! $M export-es -t vide $DIR/video.out - | cmp -s - $DIR/video.expected; then
+    echo "FAIL video export-es"
+    failures=$((failures + 1))
+else
+    echo "ok   video export-es"
+fi
+
+# The server has to go on answering while another client sits idle on a
+# connection, and mustn't follow a symlink out of the served directory.
+if [ -n "$server" ]; then
+    mkdir -p $DIR/outside
+    cp test.m4a $DIR/outside/secret.m4a
+    ln -s ../outside $DIR/corpus/outside
+    sleep 3 | curl -s telnet://127.0.0.1:$port > /dev/null &
+    idle=$!
+    sleep 0.2
+    if ! curl -sf -m 2 http://127.0.0.1:$port/test.m4a | cmp -s - $DIR/test.tree ||
+       [ "`curl -s -o /dev/null -w '%{http_code}' http://127.0.0.1:$port/outside/secret.m4a`" != 403 ]; then
+        echo "FAIL http server"
+        failures=$((failures + 1))
+    else
+        echo "ok   http server"
+    fi
+    kill $idle 2> /dev/null
+    rm $DIR/corpus/outside
+    kill $server
+fi
+
+if [ $failures -ne 0 ]; then
+    echo "$failures failures"
+    exit 1
+fi
+rm -rf $DIR
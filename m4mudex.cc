@@ -2,12 +2,8 @@
  * Removes the meta boxes from the provided mpeg4 source file, writing the result
  * out to a new file given the provided filename.
  *
- * This sample program only works for media files that stay within 32-bit box/file sizes.
- * If the file is larger than the 32-bit maximum, the following additions could be made:
- *
- * TODO
- * 1. Check for 64-bit boxes size encoding (atom size=1) and adjust accordingly.
- * 2. Find the co64 table instead of stco table, and modify those table entries.
+ * Boxes with 64-bit sizes (atom size=1) are supported, as are co64 chunk
+ * offset tables and the absolute offsets in fragmented files.
  */
 
 #include "stdio.h"
@@ -15,7 +11,32 @@
 #include "stdlib.h"
 #include "stddef.h"
 #include "string.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <linux/falloc.h>
+#include <strings.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <string>
 #include <vector>
+#include <algorithm>
 
 /* M4A atoms can be either data holders, or containers of other
  * atoms. Actually, it's slightly more complicated than that, since there
@@ -35,71 +56,758 @@
  *
  * If we were not stripping the meta box, it may have also been necessary to adjust 
  * values in the 'iloc' and 'dref' sub-boxes of the meta box, not sure.
+ *
+ * Everything we know about a box type is kept in one row of the
+ * box_types table below, keyed by its fourcc: how to parse it, where
+ * any table of file offsets in it is laid out, and which function
+ * rebases them. Supporting a new box is a matter of adding a row; any
+ * type without one is an opaque blob of data.
  */
-const char *const containers_of_interest = "moov|udta|trak|mdia|minf|stbl";
+typedef enum box_kind_t {
+    BOX_DATA,       //a blob we keep in memory and write back out
+    BOX_CONTAINER,  //a container of interest, whose children we parse
+    BOX_MEDIA,      //media data, left in the source (deferred)
+    BOX_PADDING,    //free space, never read or written
+    BOX_METADATA    //removed wherever it turns up
+} box_kind_t;
+
+struct atom_t;
+struct remap_t;
+
+//Where a box keeps a table of file offsets: an entry count, then the
+//entries. Positions are from the start of the payload, version and
+//flags included.
+typedef struct offset_layout_t {
+    //Bytes per offset, or 0 for 4 in a version 0 box and 8 otherwise
+    uint8_t width;
+    //Where the entry count is, or 0 if there's no table
+    uint8_t count_at;
+    //How much further on the count is if flags bit 0 is set
+    uint8_t flag_shift;
+    //How many offset-sized fields come before the offset in an entry
+    uint8_t field;
+    //If not 0, where the entry's trailing fields are sized: three
+    //2-bit fields, each one less than a size in bytes
+    uint8_t lengths_at;
+} offset_layout_t;
+
+typedef struct box_type_t {
+    uint32_t fourcc;
+    box_kind_t kind;
+    //The payload starts with a version byte and 24 bits of flags
+    bool full_box;
+    offset_layout_t offsets;
+    //Rebases the absolute file offsets held in the box, if it has any
+    void (*adjust)(atom_t *box, const remap_t &remap);
+    //adjust also takes care of any offsets in the box's children
+    bool adjusts_children;
+} box_type_t;
+
+//An offset table found in a box
+typedef struct offset_table_t {
+    unsigned char *entries;
+    uint32_t count;
+    int width;
+    size_t stride;
+} offset_table_t;
+
+constexpr uint32_t fourcc(const char *name) {
+    return (uint32_t)(unsigned char)name[0] << 24 | (uint32_t)(unsigned char)name[1] << 16 |
+           (uint32_t)(unsigned char)name[2] << 8 | (uint32_t)(unsigned char)name[3];
+}
+
+const box_type_t* box_type(const char *name);
+bool get_offset_table(atom_t *box, offset_table_t *table);
+
+//A run of consecutive samples stored together in the media data,
+//or more generally any range of bytes in the source.
+typedef struct chunk_t {
+    uint64_t offset;
+    uint64_t size;
+    //For a chunk of a track, the samples in it
+    uint32_t first_sample;
+    uint32_t samples;
+} chunk_t;
+
+//Part of a rewritten payload: a range of the source, or a run of zeros.
+typedef struct piece_t {
+    uint64_t offset;
+    uint64_t size;
+    bool zeros;
+} piece_t;
+
 typedef struct atom_t {
     atom_t* parent;
-    uint32_t len;
+    //Position of the box header in the source file
+    uint64_t offset;
+    uint64_t len;
+    //8, or 16 when the size is in the 64-bit largesize field
+    uint8_t header_size;
     char name[5];
-    uint32_t data_size;
-    int32_t data_remaining;
+    uint64_t data_size;
+    int64_t data_remaining;
     unsigned char* data;
     std::vector<atom_t*> children;
     bool active;
+    //The payload was left in the source rather than read into data
+    bool deferred;
+    //The size field was 0: the box runs to the end of the file
+    bool to_end;
+    //A deferred payload was rearranged (parts cut out, or padding
+    //put in); it's written as the pieces listed instead
+    bool rearranged;
+    std::vector<piece_t> pieces;
 } atom_t;
 
+//Whether a box is of the given type
+bool is_box(const atom_t *node, const char *type) {
+    return fourcc(node->name) == fourcc(type);
+}
+
+/* A SHA-256 digest, computed incrementally (FIPS 180-4). */
+typedef struct sha256_t {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t block_len;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+void sha256_init(sha256_t *h) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(h->state, initial, sizeof(initial));
+    h->length = 0;
+    h->block_len = 0;
+}
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_block(sha256_t *h, const unsigned char *p) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, k;
+    int i;
+    for(i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+    }
+    for(i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROTR(w[i-15], 7) ^ SHA256_ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = SHA256_ROTR(w[i-2], 17) ^ SHA256_ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    a = h->state[0]; b = h->state[1]; c = h->state[2]; d = h->state[3];
+    e = h->state[4]; f = h->state[5]; g = h->state[6]; k = h->state[7];
+    for(i = 0; i < 64; i++) {
+        uint32_t t1 = k + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) +
+                      ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h->state[0] += a; h->state[1] += b; h->state[2] += c; h->state[3] += d;
+    h->state[4] += e; h->state[5] += f; h->state[6] += g; h->state[7] += k;
+}
+
+void sha256_update(sha256_t *h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char*)data;
+    h->length += len;
+    if(h->block_len > 0) {
+        size_t n = 64 - h->block_len < len ? 64 - h->block_len : len;
+        memcpy(h->block + h->block_len, p, n);
+        h->block_len += n;
+        p += n;
+        len -= n;
+        if(h->block_len < 64) {
+            return;
+        }
+        sha256_block(h, h->block);
+        h->block_len = 0;
+    }
+    for(; len >= 64; p += 64, len -= 64) {
+        sha256_block(h, p);
+    }
+    memcpy(h->block, p, len);
+    h->block_len = len;
+}
+
+void sha256_final(sha256_t *h, unsigned char digest[32]) {
+    uint64_t bits = h->length * 8;
+    unsigned char pad[72];
+    size_t pad_len = (h->block_len < 56 ? 56 : 120) - h->block_len;
+    int i;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for(i = 0; i < 8; i++) {
+        pad[pad_len + i] = bits >> (56 - 8 * i);
+    }
+    sha256_update(h, pad, pad_len + 8);
+    for(i = 0; i < 32; i++) {
+        digest[i] = h->state[i / 4] >> (24 - 8 * (i % 4));
+    }
+}
+
+void sha256_hex(const unsigned char digest[32], char hex[65]) {
+    int i;
+    for(i = 0; i < 32; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+}
+
+/* A run can be cancelled with a signal (SIGINT, SIGTERM or SIGHUP), or
+ * given a deadline with --deadline, which raises SIGALRM when it passes.
+ * The handlers only note the signal. The note is checked every time the
+ * source is read, so a run stops within one block of I/O whether it's
+ * parsing, copying or hashing; since the handlers don't restart system
+ * calls, a read stuck on a slow mount is interrupted too. Any output
+ * files the run created are removed, and it exits with EXIT_CANCELLED.
+ */
+#define EXIT_CANCELLED 124
+
+volatile sig_atomic_t cancelled = 0;
+std::vector<std::string> cancel_cleanup;
+
+void cancel_handler(int sig) {
+    cancelled = sig;
+}
+
+//Give up on the run: remove its partial output and exit.
+void cancel_exit() {
+    uint32_t i;
+    for(i = 0; i < cancel_cleanup.size(); i++) {
+        unlink(cancel_cleanup[i].c_str());
+    }
+    fprintf(stderr, "%s\n", cancelled == SIGALRM ? "Deadline passed" : "Cancelled");
+    exit(EXIT_CANCELLED);
+}
+
+void check_cancel() {
+    if(cancelled) {
+        cancel_exit();
+    }
+}
+
+//Catch the cancellation signals, and arm the deadline if there is one
+//(in seconds from now).
+void cancel_setup(double deadline) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = cancel_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+    if(deadline > 0) {
+        struct itimerval timer;
+        memset(&timer, 0, sizeof(timer));
+        timer.it_value.tv_sec = (time_t)deadline;
+        timer.it_value.tv_usec = (suseconds_t)((deadline - (time_t)deadline) * 1e6);
+        if(timer.it_value.tv_sec == 0 && timer.it_value.tv_usec == 0) {
+            timer.it_value.tv_usec = 1;
+        }
+        setitimer(ITIMER_REAL, &timer, NULL);
+    }
+}
+
+/* The atoms are read from a source, which is either a seekable
+ * file or a stream (a pipe, or one member of a tar archive).
+ * Reads are sequential; pos counts the bytes consumed so far, and
+ * limit is the length of the source, or SOURCE_UNBOUNDED if that
+ * isn't known. A few bytes can be pushed back, so the end of the
+ * box list can be detected without losing any trailing data.
+ *
+ * Every byte read from the file is also passed on to the taps and
+ * the hash, if there are any, so one pass over the source can feed
+ * several outputs. A tapped source must be read from start to end
+ * without seeking.
+ *
+ * A small file may be read into memory whole first (mem), in which case
+ * reads and seeks never touch the file.
+ */
+#define SOURCE_UNBOUNDED UINT64_MAX
+
+typedef struct source_t {
+    FILE *file;
+    uint64_t pos;
+    uint64_t limit;
+    bool seekable;
+    unsigned char back[16];
+    size_t back_len;
+    std::vector<FILE*> *taps;
+    //A write to one of the taps came up short
+    bool tap_failed;
+    sha256_t *hash;
+    const unsigned char *mem;
+} source_t;
+
+source_t source_from_file(FILE *file) {
+    source_t src;
+    memset(&src, 0, sizeof(src));
+    src.file = file;
+    src.limit = SOURCE_UNBOUNDED;
+    src.seekable = fseeko(file, 0, SEEK_CUR) == 0;
+    if(src.seekable) {
+        struct stat st;
+        src.pos = ftello(file);
+        if(fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode)) {
+            src.limit = st.st_size;
+        }
+    }
+    return src;
+}
+
+//The next len bytes of a stream, read from wherever it is now.
+source_t source_from_stream(FILE *file, uint64_t len) {
+    source_t src;
+    memset(&src, 0, sizeof(src));
+    src.file = file;
+    src.limit = len;
+    return src;
+}
+
+size_t source_read(source_t *src, void *buf, size_t len) {
+    unsigned char *out = (unsigned char*)buf;
+    size_t got = 0;
+    if(len > src->limit - src->pos) {
+        len = src->limit - src->pos;
+    }
+    while(got < len && src->back_len > 0) {
+        out[got++] = src->back[sizeof(src->back) - src->back_len--];
+    }
+    if(got < len && src->mem != NULL) {
+        memcpy(out + got, src->mem + src->pos + got, len - got);
+        got = len;
+    } else if(got < len) {
+        size_t n = fread(out + got, 1, len - got, src->file);
+        if(src->taps != NULL) {
+            for(size_t i = 0; i < src->taps->size(); i++) {
+                if(fwrite(out + got, 1, n, (*src->taps)[i]) != n) {
+                    src->tap_failed = true;
+                }
+            }
+        }
+        if(src->hash != NULL) {
+            sha256_update(src->hash, out + got, n);
+        }
+        got += n;
+        check_cancel();
+    }
+    src->pos += got;
+    return got;
+}
+
+//Give back the last len bytes read, which must be in buf.
+void source_unread(source_t *src, const void *buf, size_t len) {
+    memcpy(src->back + sizeof(src->back) - len, buf, len);
+    src->back_len = len;
+    src->pos -= len;
+}
+
+//Move the source to the given absolute position. Streams can
+//only move forward, by reading and discarding.
+int source_seek(source_t *src, uint64_t pos) {
+    if(src->mem != NULL) {
+        if(pos > src->limit) {
+            return -1;
+        }
+        src->back_len = 0;
+        src->pos = pos;
+        return 0;
+    }
+    if(src->seekable && src->back_len == 0) {
+        if(fseeko(src->file, pos, SEEK_SET) != 0) {
+            return -1;
+        }
+        src->pos = pos;
+        return 0;
+    }
+    unsigned char buf[65536];
+    while(src->pos < pos) {
+        uint64_t want = pos - src->pos;
+        if(source_read(src, buf, want > sizeof(buf) ? sizeof(buf) : want) == 0) {
+            return -1;
+        }
+    }
+    return src->pos == pos ? 0 : -1;
+}
+
+/* Files up to this size are read whole with one read, parsed in memory,
+ * and written with writev, so a run over a small song costs a handful of
+ * syscalls rather than a few for every box. --small-file-max changes it. */
+#define SMALL_FILE_MAX (16 << 20)
+
+//Read len bytes at offset in fd, however many preads that takes.
+//Returns 0, or -1 if the file ends first.
+int pread_all(int fd, void *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t n = pread(fd, (unsigned char*)buf + done, len - done, offset + done);
+        if(n < 0 && errno == EINTR) {
+            check_cancel();
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+//Read the first size bytes of fd into a new buffer.
+//Returns NULL if the file is shorter than that.
+unsigned char *read_whole(int fd, uint64_t size) {
+    unsigned char *buf = (unsigned char*)malloc(size > 0 ? size : 1);
+    if(pread_all(fd, buf, size, 0) != 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+bool is_pipe(FILE *file) {
+    struct stat st;
+    return fstat(fileno(file), &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+//Move len bytes at offset in a seekable source straight into the pipe
+//out with splice, so the kernel hands the page cache pages over
+//without copying them through user space. Anything already buffered
+//for out is flushed first, to keep the order. Returns 1 if splice
+//isn't supported for this file, so the caller can copy instead.
+int source_splice(source_t *src, uint64_t offset, uint64_t len, FILE *out) {
+    loff_t in_off = offset;
+    bool moved = false;
+    if(fflush(out) != 0) {
+        return -1;
+    }
+    while(len > 0) {
+        ssize_t n = splice(fileno(src->file), &in_off, fileno(out), NULL,
+                           len > (1 << 30) ? (1 << 30) : len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(n < 0 && errno == EINTR) {
+            check_cancel();
+            continue;
+        }
+        if(n < 0 && !moved && (errno == EINVAL || errno == ENOSYS)) {
+            return 1;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        moved = true;
+        len -= n;
+    }
+    //splice doesn't move the file position, and the stdio buffer
+    //may be stale; seeking brings both up to date.
+    src->pos = in_off;
+    return fseeko(src->file, in_off, SEEK_SET);
+}
+
+//Copy len bytes starting at offset in the source to out.
+int source_copy(source_t *src, uint64_t offset, uint64_t len, FILE *out) {
+    unsigned char buf[65536];
+    //Only a seekable source can be spliced from: a stream's stdio
+    //buffer may already hold what comes next. Taps and the hash need
+    //to see the bytes, so they have to be read in too.
+    if(src->seekable && src->taps == NULL && src->hash == NULL && src->back_len == 0 &&
+       len > 0 && is_pipe(out)) {
+        int ret = source_splice(src, offset, len, out);
+        if(ret <= 0) {
+            return ret;
+        }
+    }
+    if(src->pos != offset && source_seek(src, offset) != 0) {
+        return -1;
+    }
+    while(len > 0) {
+        size_t n = source_read(src, buf, len > sizeof(buf) ? sizeof(buf) : len);
+        if(n == 0 || fwrite(buf, 1, n, out) != n) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+//Media data is never needed to edit the box structure, so its
+//payload stays in the source and is copied straight to the output.
+bool is_deferred_box(const char *name) {
+    return box_type(name)->kind == BOX_MEDIA;
+}
+
+//Padding boxes carry no information; their payload may be
+//anything, so we're free to leave it as a hole in the file.
+//QuickTime's wide is an empty box that's there to be overwritten
+//if the box after it needs a 64-bit size.
+bool is_padding_box(const char *name) {
+    return box_type(name)->kind == BOX_PADDING;
+}
+
+uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+uint64_t get_be64(const unsigned char *p) {
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void put_be64(unsigned char *p, uint64_t v) {
+    put_be32(p, v >> 32);
+    put_be32(p + 4, v);
+}
+
+//Fill in the header of a box as it will be written out,
+//which is header_size bytes long.
+void put_box_header(const atom_t *atom, unsigned char *header) {
+    if(atom->to_end) {
+        put_be32(header, 0);
+    } else if(atom->header_size == 16) {
+        put_be32(header, 1);
+        put_be64(header + 8, atom->len);
+    } else {
+        put_be32(header, atom->len);
+    }
+    memcpy(header + 4, atom->name, 4);
+}
+
+void append_be16(std::string &out, uint16_t v) {
+    out += (char)(v >> 8);
+    out += (char)v;
+}
+
+void append_be32(std::string &out, uint32_t v) {
+    append_be16(out, v >> 16);
+    append_be16(out, v);
+}
+
+void append_be64(std::string &out, uint64_t v) {
+    append_be32(out, v >> 32);
+    append_be32(out, v);
+}
+
+std::string make_box(const char *name, const std::string &payload) {
+    std::string out;
+    append_be32(out, payload.size() + 8);
+    return out + std::string(name, 4) + payload;
+}
+
+//A FullBox; the version goes in the top byte of flags
+std::string make_full_box(const char *name, uint32_t flags, const std::string &payload) {
+    std::string out;
+    append_be32(out, flags);
+    return make_box(name, out + payload);
+}
 
 /***
  * Find the next box (atom) starting from the current
- * position of the provided m4a file. 
+ * position of the provided source.
  *
  * Allocates memory for the atom if necessary, and returns 
  * a new atom_t with information about the new atom.
  */
-atom_t* get_next_box(FILE* m4a_file) {
-    atom_t *atom = (atom_t*)malloc(sizeof(atom_t));
+atom_t* get_next_box(source_t* src) {
+    atom_t *atom = (atom_t*)calloc(sizeof(atom_t), 1);
+    unsigned char header[16];
+    atom->offset = src->pos;
+    atom->header_size = 8;
    
-    /* Read size in big-endian order */
-    fread(&atom->len, 4, 1, m4a_file);
-    atom->active = true;
-    atom->len = htonl(atom->len);
-    
-    fread(atom->name, 1, 4, m4a_file);
+    /* Read size in big-endian order. */
+    size_t got = source_read(src, header, 8);
+    atom->len = get_be32(header);
    
     /* If the standard length word is 1, then we
      * expect an 8-byte length immediately follow
      * the name.
      *
      * Also the header is effectively 16 bytes now. */ 
-    //if(atom->len == 1) {
-        /* Read in big-endian order */
-    //    for(i = 7; i >= 0; i--) {
-    //        fread(&(atom->len.bytes[i]), 1, 1, m4a_file);
-    //    }
-    //    atom->data_size = atom->len.word - 16;
-    //} else {
-        atom->data_size = atom->len - 8;
-    //}
+    if(got == 8 && atom->len == 1) {
+        got += source_read(src, header + 8, 8);
+        atom->len = get_be64(header + 8);
+        atom->header_size = 16;
+    }
+
+    /* A size of 0 means the box runs to the end of the file, as
+     * QuickTime writes an mdat whose length it didn't know up front.
+     * That can only be honored if we know where the end is. */
+    if(got == 8 && atom->len == 0 && src->limit != SOURCE_UNBOUNDED) {
+        atom->len = src->limit - atom->offset;
+        atom->to_end = true;
+    }
+
+    /* A short read, or a size we can't handle, means we've run out
+     * of boxes; whatever was read is pushed back, and the caller sees
+     * a zero-length atom. */
+    if(got < atom->header_size || atom->len < atom->header_size ||
+       atom->len > src->limit - atom->offset) {
+        source_unread(src, header, got);
+        atom->len = 0;
+        return atom;
+    }
+    memcpy(atom->name, header + 4, 4);
+    atom->active = true;
+    atom->data_size = atom->len - atom->header_size;
 
     /* Initialize the struct depending on whether 
      * it's a container of interest or just a 
      * data blob to pass through.
      */
-    if(strstr(containers_of_interest, atom->name) != 0) {
+    switch(box_type(atom->name)->kind) {
+    case BOX_CONTAINER:
         //If it's a container, mark the size in data_remaining so the main loop
         //knows how much to process
         atom->data = NULL;
         atom->data_remaining = atom->data_size;
-    } else {
+        break;
+    case BOX_PADDING:
+        //Padding is never written back out, so don't bother reading it
+        atom->data = NULL;
+        atom->data_remaining = 0;
+        source_seek(src, src->pos + atom->data_size);
+        break;
+    case BOX_MEDIA:
+        //Leave the payload where it is; the caller decides whether to
+        //skip over it or stream it to the output.
+        atom->data = NULL;
+        atom->deferred = true;
+        atom->data_remaining = 0;
+        break;
+    default:
         //Otherwise, just throw the data in a char blob
         //to dump back out later
         atom->data = (unsigned char*)malloc(atom->data_size);;
-        fread(atom->data, atom->data_size, 1, m4a_file);
+        source_read(src, atom->data, atom->data_size);
         atom->data_remaining = 0;
+        break;
+    }
+    return atom;
+}
+
+//QuickTime ends some lists of atoms (in udta, for one) with a 32-bit
+//zero. Whatever is left of a container that's too short to be a box is
+//kept as a run of bytes with no header.
+atom_t* get_filler(source_t *src, uint64_t len) {
+    atom_t *atom = (atom_t*)calloc(sizeof(atom_t), 1);
+    atom->offset = src->pos;
+    atom->data = (unsigned char*)malloc(len);
+    if(source_read(src, atom->data, len) != len) {
+        return atom;
     }
+    atom->len = len;
+    atom->data_size = len;
+    atom->active = true;
     return atom;
 }
 
+void free_tree(atom_t *node) {
+    uint32_t i;
+    for(i = 0; i < node->children.size(); i++) {
+        free_tree(node->children[i]);
+    }
+    free(node->data);
+    node->children.~vector();
+    node->pieces.~vector();
+    free(node);
+}
+
+//Find a box by its path below node, e.g. "mdia/minf/stbl/stco".
+//Only boxes that were parsed into the tree can be found.
+atom_t* find_box(atom_t *node, const char *path) {
+    uint32_t i;
+    while(*path != 0) {
+        atom_t *next = NULL;
+        for(i = 0; i < node->children.size() && next == NULL; i++) {
+            if(node->children[i]->active && fourcc(node->children[i]->name) == fourcc(path)) {
+                next = node->children[i];
+            }
+        }
+        if(next == NULL) {
+            return NULL;
+        }
+        node = next;
+        path += path[4] == '/' ? 5 : 4;
+    }
+    return node;
+}
+
+//Work out where each chunk of a track is and how big it is,
+//from the stco, stsc and stsz tables.
+//Returns 0, or -1 if the tables are missing or inconsistent.
+int get_track_chunks(atom_t *trak, std::vector<chunk_t> &chunks) {
+    atom_t *stco = find_box(trak, "mdia/minf/stbl/stco");
+    atom_t *stsc = find_box(trak, "mdia/minf/stbl/stsc");
+    atom_t *stsz = find_box(trak, "mdia/minf/stbl/stsz");
+    offset_table_t offsets;
+    uint32_t i, j;
+    chunks.clear();
+    if(stco == NULL) {
+        stco = find_box(trak, "mdia/minf/stbl/co64");
+    }
+    if(stco == NULL || stsc == NULL || stsz == NULL || !get_offset_table(stco, &offsets) ||
+       stsc->data_size < 8 || stsz->data_size < 12) {
+        return -1;
+    }
+    uint32_t chunk_count = offsets.count;
+    uint32_t stsc_count = get_be32(stsc->data + 4);
+    uint32_t sample_size = get_be32(stsz->data + 4);
+    uint32_t sample_count = get_be32(stsz->data + 8);
+    if(8 + 12 * (uint64_t)stsc_count > stsc->data_size ||
+       (sample_size == 0 && 12 + 4 * (uint64_t)sample_count > stsz->data_size)) {
+        return -1;
+    }
+
+    uint32_t sample = 0;
+    for(i = 0; i < stsc_count; i++) {
+        //Each stsc entry covers the chunks up to the next entry's first chunk
+        const unsigned char *entry = stsc->data + 8 + 12 * i;
+        uint32_t first = get_be32(entry);
+        uint32_t last = i + 1 < stsc_count ? get_be32(entry + 12) : chunk_count + 1;
+        uint32_t per_chunk = get_be32(entry + 4);
+        if(first < 1 || last < first || last > chunk_count + 1) {
+            return -1;
+        }
+        for(j = first; j < last; j++) {
+            chunk_t chunk;
+            const unsigned char *slot = offsets.entries + offsets.stride * (j - 1);
+            chunk.offset = offsets.width == 8 ? get_be64(slot) : get_be32(slot);
+            chunk.size = 0;
+            chunk.first_sample = sample;
+            chunk.samples = per_chunk;
+            if(sample + (uint64_t)per_chunk > sample_count) {
+                return -1;
+            }
+            if(sample_size != 0) {
+                chunk.size = (uint64_t)sample_size * per_chunk;
+            } else {
+                for(uint32_t k = 0; k < per_chunk; k++) {
+                    chunk.size += get_be32(stsz->data + 12 + 4 * (sample + k));
+                }
+            }
+            sample += per_chunk;
+            chunks.push_back(chunk);
+        }
+    }
+    return chunks.size() == chunk_count ? 0 : -1;
+}
+
 // A little function to look for meta tags in a less structured way
 // Just used for testing
 // Could possibly result in a false positive if the "meta" tag appears 
@@ -129,6 +837,12 @@ int find_meta(FILE *m4a_file) {
     return -1; 
 }
 
+//find_meta for a file held in memory.
+int find_meta_mem(const unsigned char *buf, size_t len) {
+    const unsigned char *found = (const unsigned char*)memmem(buf, len, "meta", 4);
+    return found != NULL ? found - buf + 4 : -1;
+}
+
 /* Print out the atom tree representation
  * on stdout
  */
@@ -139,17 +853,17 @@ void print_tree_rec(atom_t* node, uint8_t level) {
     }
     //skip root content, it's not *really* an atom
     if(node->parent != NULL) { 
-        printf("%u %s", node->len, node->name);
-        if(strncmp(node->name, "stco", 4) == 0) {
-            uint32_t stco_entries = htonl(*((uint32_t*)(node->data + 4)));
-            printf(" (%d entries)", stco_entries);
-            for(i=0; i <= (10 > stco_entries ? stco_entries : 10); i++) {
-                printf(" %d ", htonl(*((uint32_t*)(node->data + 8 + 4*i))));    
-            }
-            if(stco_entries > 10) {
+        printf("%llu %s", (unsigned long long)node->len, node->name);
+        offset_table_t table;
+        if(get_offset_table(node, &table)) {
+            printf(" (%u entries)", table.count);
+            for(uint32_t j = 0; j < table.count && j < 10; j++) {
+                const unsigned char *p = table.entries + table.stride * j;
+                printf(" %llu ", (unsigned long long)(table.width == 8 ? get_be64(p) : get_be32(p)));
+            }
+            if(table.count > 10) {
                 printf("...");
             }
-            
         }
         printf("\n");
     }
@@ -163,197 +877,5058 @@ void print_tree(atom_t* node) {
     print_tree_rec(node, 0);
 }
 
+//Release the disk blocks backing [offset, offset+len) of fd.
+//The file keeps its size and the range reads back as zeros.
+//If the filesystem can't punch holes, zero the range instead
+//so the result is the same, just not sparse.
+int punch_hole(int fd, uint64_t offset, uint64_t len) {
+    if(len == 0) {
+        return 0;
+    }
+    if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return 0;
+    }
+    if(errno != EOPNOTSUPP && errno != ENOSYS) {
+        return -1;
+    }
+    unsigned char zeros[4096];
+    memset(zeros, 0, sizeof(zeros));
+    while(len > 0) {
+        size_t n = len > sizeof(zeros) ? sizeof(zeros) : len;
+        ssize_t w = pwrite(fd, zeros, n, offset);
+        if(w <= 0) {
+            return -1;
+        }
+        offset += w;
+        len -= w;
+    }
+    return 0;
+}
+
+void write_zeros(FILE *out_file, uint64_t len) {
+    unsigned char zeros[4096];
+    memset(zeros, 0, sizeof(zeros));
+    while(len > 0) {
+        check_cancel();
+        size_t n = len > sizeof(zeros) ? sizeof(zeros) : len;
+        fwrite(zeros, 1, n, out_file);
+        len -= n;
+    }
+}
+
 //Write the atoms back out to file.
-void output_tree(atom_t* node, FILE *out_file) {
+//Deferred payloads are copied over from the source.
+//The payload of padding boxes is always written as zeros. If the
+//output is seekable, it's skipped over instead of written, leaving
+//a hole; the caller must then call finish_output so a trailing
+//hole gets a size.
+void output_tree(atom_t* node, FILE *out_file, source_t *src) {
     uint32_t i;
     
     //skip root content, it's not *really* an atom
     if(node->parent != NULL) {
-        uint32_t out_len = htonl(node->len);
-        fwrite(&out_len, 4, 1, out_file);
-        fwrite(node->name, 4, 1, out_file);
-        if(node->data_size > 0 && node->data != NULL) {
+        unsigned char header[16];
+        put_box_header(node, header);
+        fwrite(header, 1, node->header_size, out_file);
+        if(is_padding_box(node->name)) {
+            if(fseeko(out_file, node->data_size, SEEK_CUR) != 0) {
+                write_zeros(out_file, node->data_size);
+            }
+        } else if(node->deferred && node->rearranged) {
+            for(i = 0; i < node->pieces.size(); i++) {
+                const piece_t &piece = node->pieces[i];
+                if(piece.zeros) {
+                    write_zeros(out_file, piece.size);
+                } else if(source_copy(src, piece.offset, piece.size, out_file) != 0) {
+                    printf("Could not copy %s payload from the source\n", node->name);
+                    exit(1);
+                }
+            }
+        } else if(node->deferred) {
+            if(source_copy(src, node->offset + node->header_size, node->data_size, out_file) != 0) {
+                printf("Could not copy %s payload from the source\n", node->name);
+                exit(1);
+            }
+        } else if(node->data_size > 0 && node->data != NULL) {
             fwrite(node->data, node->data_size, 1, out_file);
         }
     }
 
     for(i=0; i < node->children.size(); i++) {
         if(node->children[i]->active == true) {
-            output_tree(node->children[i], out_file);
+            output_tree(node->children[i], out_file, src);
         }
     }
 }
 
-//Given an atom that we expect to be a stco block,
-//and an offset_adjustment, fix the data portion of the 
-//atom so that the offsets are reduced by the adjustment
-//amount
-void adjust_stco_offset(atom_t *stco, int offset_adjust) {
-    int i;
-    //Offset past the version byte
-    unsigned char* stco_data_ptr = (stco->data + 4);
-    int stco_entries = htonl(*((uint32_t*)(stco_data_ptr)));
-
-    //Ofset version bytes and length bytes 
-    stco_data_ptr = stco->data + 8;
-
-    //Read the bytes in big-endian order,
-    //subtract offset, 
-    //write back out.
-    for(i = 0; i < stco_entries; i++) {
-        uint32_t stco_offset = htonl(*((uint32_t*)(stco_data_ptr)));
-        stco_offset -= offset_adjust;
-        *((uint32_t*)stco_data_ptr) = htonl(stco_offset);
-        stco_data_ptr += 4;
-    }
-}
-
-//Strip meta boxes, returning the size of
-//meta tags before mdat boxes for later
-//adjustment.
-//It adds up all meta box sizes occurring before mdat, and returns them in accumulator
-//That value can subsequently be used to adjust other chunk offsets.
-void strip_meta_box_rec(atom_t *node, bool do_accumulate, uint32_t &accumulator, atom_t **stco) {
-    uint32_t i;
-    if(strncmp(node->name, "mdat", 4) == 0) {
-        do_accumulate = false;
-    } else if(strncmp(node->name, "stco", 4) == 0) {
-        *stco = node;
-    } else if(do_accumulate && strncmp(node->name, "meta", 4) == 0) {
-        accumulator += node->len;
-        node->active = false;
-
-        //Fix up this meta box's parent box sizes
-        atom_t *cur = node->parent;
-        while(cur != NULL)  {
-            cur->len -= node->len;
-            cur = cur->parent;
-        }
-    } 
-    for(i = 0; i < node->children.size(); i++) {
-        strip_meta_box_rec(node->children[i], do_accumulate, accumulator, stco);
+//Seeking past the end of a file doesn't extend it, so if the
+//tree ended in a padding hole, set the final length explicitly.
+//Anything else (a pipe, a device) was never seeked, so has nothing
+//to set. Returns 0, or -1 if the output couldn't be written.
+int finish_output(FILE *out_file) {
+    struct stat st;
+    off_t end = ftello(out_file);
+    if(fflush(out_file) != 0) {
+        return -1;
     }
-}
-void strip_meta_box(atom_t *node) {
-    uint32_t offset_adjust = 0;
-    atom_t* stco;
-    strip_meta_box_rec(node, true, offset_adjust, &stco);
-    adjust_stco_offset(stco, offset_adjust);
+    if(end <= 0 || fstat(fileno(out_file), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    return ftruncate(fileno(out_file), end);
 }
 
+/* Removing a box moves everything after it. Each edit to the file is
+ * recorded as a position in the source and the change in length there
+ * (negative for bytes removed), and every absolute offset in the file
+ * is then mapped through all of the edits ahead of it.
+ *
+ * The remap table holds the edit positions in sorted order, and the
+ * running total of the changes: an offset with n edits at or before it
+ * moves by shift[n].
+ */
+typedef struct edit_t {
+    uint64_t offset;
+    int64_t delta;
+} edit_t;
 
-//Create a representation of the tree structure of the atoms
-//This function is called recursively. If an atom is marked as a 
-//container, move through the data section of the atom sub-atom
-//at a time, otherwise just dump the whole data thing into a blob.
-atom_t* build_tree(FILE* m4a_file) {
+typedef struct remap_t {
+    std::vector<uint64_t> offsets;
+    std::vector<int64_t> shift;
+} remap_t;
 
-    //Place to hold the current working atom.
-    atom_t *atom;
-    
-    //Create an abstract root node to hold the top-level
-    //atom list.
-    atom_t *root = (atom_t*)calloc(sizeof(atom_t), 1);
+bool edit_before(const edit_t &a, const edit_t &b) {
+    return a.offset < b.offset;
+}
 
-    atom_t *current_parent = root;
+void build_remap(std::vector<edit_t> &edits, remap_t &remap) {
+    uint32_t i;
+    std::sort(edits.begin(), edits.end(), edit_before);
+    remap.offsets.resize(edits.size());
+    remap.shift.resize(edits.size() + 1);
+    remap.shift[0] = 0;
+    for(i = 0; i < edits.size(); i++) {
+        remap.offsets[i] = edits[i].offset;
+        remap.shift[i + 1] = remap.shift[i] + edits[i].delta;
+    }
+}
 
-    /* Loop through the rest of the atoms */
-    while((atom = get_next_box(m4a_file))->len > 0) {
-        //Set the parent of the newly created atom
-        atom->parent = current_parent; 
+//The number of edits at or before offset. The search narrows the range
+//with conditional moves rather than branches, since the comparisons
+//are unpredictable.
+size_t remap_count(const remap_t &remap, uint64_t offset) {
+    const uint64_t *first = remap.offsets.data();
+    size_t len = remap.offsets.size();
+    while(len > 0) {
+        size_t half = len / 2;
+        bool after = first[half] <= offset;
+        first = after ? first + half + 1 : first;
+        len = after ? len - half - 1 : half;
+    }
+    return first - remap.offsets.data();
+}
 
-        //Add new atom to the current parent list.
-        current_parent->children.push_back(atom);
+uint64_t remap_offset(const remap_t &remap, uint64_t offset) {
+    return offset + remap.shift[remap_count(remap, offset)];
+}
 
-        //Subtract size of current atom from
-        //the data_remaining of the parent
-        //Note: this must occur before the next step
-        //which might change the level. Don't try to
-        //include it in the following step.
-        if(current_parent != root) {
-            current_parent->data_remaining -= atom->len;
+//Remap a table of count big-endian offsets, each width bytes wide,
+//stored stride bytes apart. Tables are almost always in increasing
+//order, so the edits are walked alongside the entries as in a merge;
+//an entry out of order restarts the walk with a binary search.
+void remap_offset_table(const remap_t &remap, unsigned char *p, uint32_t count,
+                        int width, size_t stride) {
+    size_t edit = 0;
+    size_t edit_count = remap.offsets.size();
+    uint64_t prev = 0;
+    uint32_t i;
+    if(edit_count == 0) {
+        return;
+    }
+    for(i = 0; i < count; i++, p += stride) {
+        uint64_t offset = width == 8 ? get_be64(p) : get_be32(p);
+        if(offset < prev) {
+            edit = remap_count(remap, offset);
         }
-
-        //If the atom has data_remaining set, then must have some children
-        if(atom->data_remaining > 0) {
-            current_parent = atom;
+        while(edit < edit_count && remap.offsets[edit] <= offset) {
+            edit++;
         }
-
-        //Check if we have data remaining in the parent.
-        //If not, if atom was the last one in the parent.
-        //So, move back up one level
-        if(current_parent != root) {
-            //Make sure we haven't overrun any expected sizes in the parent 
-            if(current_parent->data_remaining < 0) {
-                printf("Something wrong: child atom overruns the parent size.");
-                printf("Parent name is: %s\n",current_parent->name);
-                exit(0);
-            } 
-
-            //We're done getting the children of this parent, move back up.
-            while (current_parent && current_parent->parent && current_parent->data_remaining == 0) {
-                current_parent = current_parent->parent;
-            }
+        prev = offset;
+        offset += remap.shift[edit];
+        if(width == 8) {
+            put_be64(p, offset);
+        } else {
+            put_be32(p, offset);
         }
     }
-    
-    return root;
 }
 
-int main(int argc, char** argv) {
+//Find the offset table a box's row lays out.
+//Returns false if it has none, or it doesn't fit in the box.
+bool get_offset_table(atom_t *box, offset_table_t *table) {
+    const offset_layout_t &layout = box_type(box->name)->offsets;
+    size_t at = layout.count_at;
+    size_t extra = 0;
+    if(at == 0 || box->data_size < 4) {
+        return false;
+    }
+    table->width = layout.width != 0 ? layout.width : box->data[0] == 0 ? 4 : 8;
+    if(get_be32(box->data) & 0x000001) {
+        at += layout.flag_shift;
+    }
+    if(layout.lengths_at != 0) {
+        if(layout.lengths_at + 4u > box->data_size) {
+            return false;
+        }
+        uint32_t sizes = get_be32(box->data + layout.lengths_at);
+        extra = ((sizes >> 4) & 3) + ((sizes >> 2) & 3) + (sizes & 3) + 3;
+    }
+    if(at + 4 > box->data_size) {
+        return false;
+    }
+    table->count = get_be32(box->data + at);
+    table->stride = (size_t)table->width * (layout.field + 1) + extra;
+    if(at + 4 + (uint64_t)table->stride * table->count > box->data_size) {
+        return false;
+    }
+    table->entries = box->data + at + 4 + (size_t)table->width * layout.field;
+    return true;
+}
+
+//Rebase a table of absolute offsets (stco, co64, a saio in a sample
+//table, tfra).
+void adjust_offset_table(atom_t *box, const remap_t &remap) {
+    offset_table_t table;
+    if(get_offset_table(box, &table)) {
+        remap_offset_table(remap, table.entries, table.count, table.width, table.stride);
+    }
+}
+
+//Rebase the sample auxiliary information offsets (used by Common
+//Encryption for the per-sample IVs and subsample maps) of a track
+//fragment. They're relative to the fragment's base offset, given in
+//base.
+void adjust_traf_saio_offsets(atom_t *saio, const remap_t &remap, uint64_t base) {
+    offset_table_t table;
+    uint32_t i;
+    if(!get_offset_table(saio, &table)) {
+        return;
+    }
+    uint64_t new_base = remap_offset(remap, base);
+    unsigned char *p = table.entries;
+    for(i = 0; i < table.count; i++, p += table.stride) {
+        uint64_t offset = table.width == 8 ? get_be64(p) : get_be32(p);
+        offset = remap_offset(remap, base + offset) - new_base;
+        if(table.width == 8) {
+            put_be64(p, offset);
+        } else {
+            put_be32(p, offset);
+        }
+    }
+}
+
+//Rebase the offsets in a track fragment. The tfhd base data offset is
+//absolute. trun data offsets and saio offsets are relative to the base
+//data offset, or to the start of the moof if there isn't one; they only
+//change if an edit falls between the base and the data.
+void adjust_traf_offsets(atom_t *traf, const remap_t &remap) {
+    atom_t *tfhd = find_box(traf, "tfhd");
+    uint64_t base = traf->parent->offset;
+    uint32_t i;
+    if(tfhd == NULL || tfhd->data_size < 8) {
+        return;
+    }
+    if((get_be32(tfhd->data) & 0x000001) && tfhd->data_size >= 16) {
+        base = get_be64(tfhd->data + 8);
+        put_be64(tfhd->data + 8, remap_offset(remap, base));
+    }
+    for(i = 0; i < traf->children.size(); i++) {
+        atom_t *child = traf->children[i];
+        switch(fourcc(child->name)) {
+        case fourcc("saio"):
+            adjust_traf_saio_offsets(child, remap, base);
+            break;
+        case fourcc("trun"):
+            if(child->data_size >= 12 && (get_be32(child->data) & 0x000001)) {
+                int32_t data_offset = get_be32(child->data + 8);
+                int64_t moved = remap_offset(remap, base + data_offset) - remap_offset(remap, base);
+                put_be32(child->data + 8, (uint32_t)moved);
+            }
+            break;
+        }
+    }
+}
+
+//Sorted by fourcc, for box_type's binary search
+constexpr box_type_t box_types[] = {
+    { fourcc("co64"), BOX_DATA, true, { 8, 4, 0, 0, 0 }, adjust_offset_table, false },
+    { fourcc("free"), BOX_PADDING, false, {}, NULL, false },
+    { fourcc("hdlr"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("mdat"), BOX_MEDIA, false, {}, NULL, false },
+    { fourcc("mdhd"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("mdia"), BOX_CONTAINER, false, {}, NULL, false },
+    //An ISO meta box is a FullBox, a QuickTime one isn't; it makes no
+    //difference, since it's removed whole.
+    { fourcc("meta"), BOX_METADATA, false, {}, NULL, false },
+    { fourcc("mfra"), BOX_CONTAINER, false, {}, NULL, false },
+    { fourcc("mfro"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("minf"), BOX_CONTAINER, false, {}, NULL, false },
+    { fourcc("moof"), BOX_CONTAINER, false, {}, NULL, false },
+    { fourcc("moov"), BOX_CONTAINER, false, {}, NULL, false },
+    { fourcc("mvex"), BOX_CONTAINER, false, {}, NULL, false },
+    { fourcc("mvhd"), BOX_DATA, true, {}, NULL, false },
+    //The aux_info_type fields come ahead of the count if flags bit 0 is
+    //set. A saio in a track fragment is rebased along with the traf.
+    { fourcc("saio"), BOX_DATA, true, { 0, 4, 8, 0, 0 }, adjust_offset_table, false },
+    { fourcc("saiz"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("sidx"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("skip"), BOX_PADDING, false, {}, NULL, false },
+    { fourcc("stbl"), BOX_CONTAINER, false, {}, NULL, false },
+    { fourcc("stco"), BOX_DATA, true, { 4, 4, 0, 0, 0 }, adjust_offset_table, false },
+    { fourcc("stsc"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("stsd"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("stss"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("stsz"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("stts"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("tfdt"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("tfhd"), BOX_DATA, true, {}, NULL, false },
+    //Each entry is a time, the moof offset, then the traf, trun and
+    //sample numbers, sized by the word after the track id.
+    { fourcc("tfra"), BOX_DATA, true, { 0, 12, 0, 1, 8 }, adjust_offset_table, false },
+    { fourcc("tkhd"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("traf"), BOX_CONTAINER, false, {}, adjust_traf_offsets, true },
+    { fourcc("trak"), BOX_CONTAINER, false, {}, NULL, false },
+    { fourcc("trex"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("trun"), BOX_DATA, true, {}, NULL, false },
+    { fourcc("udta"), BOX_CONTAINER, false, {}, NULL, false },
+    //QuickTime's wide is an empty box that's there to be overwritten
+    //if the box after it needs a 64-bit size.
+    { fourcc("wide"), BOX_PADDING, false, {}, NULL, false },
+};
+
+constexpr bool box_types_sorted() {
+    for(size_t i = 1; i < sizeof(box_types) / sizeof(box_types[0]); i++) {
+        if(box_types[i - 1].fourcc >= box_types[i].fourcc) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(box_types_sorted(), "box_types has to be sorted by fourcc");
+
+//Anything without a row of its own
+const box_type_t unknown_box_type = { 0, BOX_DATA, false, {}, NULL, false };
+
+const box_type_t* box_type(const char *name) {
+    uint32_t key = fourcc(name);
+    size_t low = 0;
+    size_t high = sizeof(box_types) / sizeof(box_types[0]);
+    while(low < high) {
+        size_t mid = (low + high) / 2;
+        if(box_types[mid].fourcc < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if(low < sizeof(box_types) / sizeof(box_types[0]) && box_types[low].fourcc == key) {
+        return &box_types[low];
+    }
+    return &unknown_box_type;
+}
+
+//The boxes holding file offsets that have to follow edits. One whose
+//parent rebases its children (a saio in a track fragment) is taken
+//care of along with the parent.
+bool has_offsets(const atom_t *node) {
+    if(box_type(node->name)->adjust == NULL) {
+        return false;
+    }
+    return node->parent == NULL || !box_type(node->parent->name)->adjusts_children;
+}
+
+void adjust_offsets(std::vector<atom_t*> &boxes, const remap_t &remap) {
+    uint32_t i;
+    for(i = 0; i < boxes.size(); i++) {
+        check_cancel();
+        box_type(boxes[i]->name)->adjust(boxes[i], remap);
+    }
+}
+
+//The boxes that hold metadata, all of which are removed: meta boxes
+//wherever they are (ISO ones, and QuickTime ones, which have no version
+//and flags and keep their items in keys and ilst), and the QuickTime
+//user data text atoms, whose types start with a ©, such as ©xyz (the
+//GPS position), ©mak and ©mod (the camera) and ©day.
+bool is_metadata_box(const atom_t *node) {
+    if(node->parent == NULL) {
+        return false;
+    }
+    if(box_type(node->name)->kind == BOX_METADATA) {
+        return true;
+    }
+    return (unsigned char)node->name[0] == 0xa9 && is_box(node->parent, "udta");
+}
+
+//Strip metadata boxes wherever they are, recording an edit for each one
+//removed, and collect the boxes holding offsets that need adjusting.
+void strip_meta_box_rec(atom_t *node, std::vector<edit_t> &edits, std::vector<atom_t*> &offset_boxes) {
+    uint32_t i;
+    if(node->parent != NULL && !node->active) {
+        //Already removed, along with everything in it
+        return;
+    }
+    if(has_offsets(node)) {
+        offset_boxes.push_back(node);
+    } else if(is_metadata_box(node)) {
+        edit_t edit = { node->offset, -(int64_t)node->len };
+        edits.push_back(edit);
+        node->active = false;
+
+        //Fix up this meta box's parent box sizes
+        atom_t *cur = node->parent;
+        while(cur != NULL)  {
+            cur->len -= node->len;
+            cur = cur->parent;
+        }
+        return;
+    } 
+    for(i = 0; i < node->children.size(); i++) {
+        strip_meta_box_rec(node->children[i], edits, offset_boxes);
+    }
+}
+
+//Turn metadata boxes into free boxes of the same size, so nothing
+//moves. Also collects the boxes holding offsets.
+void blank_meta_box_rec(atom_t *node, std::vector<atom_t*> &offset_boxes) {
+    uint32_t i;
+    if(has_offsets(node)) {
+        offset_boxes.push_back(node);
+    } else if(is_metadata_box(node)) {
+        memcpy(node->name, "free", 4);
+        free(node->data);
+        node->data = NULL;
+    }
+    for(i = 0; i < node->children.size(); i++) {
+        blank_meta_box_rec(node->children[i], offset_boxes);
+    }
+}
+
+//Strip all meta boxes and fix up the offsets that moved.
+//Returns the number of bytes removed.
+uint64_t strip_meta_box(atom_t *node) {
+    std::vector<edit_t> edits;
+    std::vector<atom_t*> offset_boxes;
+    remap_t remap;
+    strip_meta_box_rec(node, edits, offset_boxes);
+    build_remap(edits, remap);
+    adjust_offsets(offset_boxes, remap);
+    return -remap.shift.back();
+}
+
+//The track_ID from a trak's tkhd, or 0 if it can't be read.
+uint32_t get_track_id(atom_t *trak) {
+    atom_t *tkhd = find_box(trak, "tkhd");
+    if(tkhd == NULL || tkhd->data_size < 24) {
+        return 0;
+    }
+    return get_be32(tkhd->data + (tkhd->data[0] == 1 ? 20 : 12));
+}
+
+//A track is selected by its track ID, or by its handler type
+//(soun, vide, text, sbtl, ...).
+bool track_selected(atom_t *trak, const std::vector<std::string> &selectors) {
+    atom_t *hdlr = find_box(trak, "mdia/hdlr");
+    uint32_t i;
+    for(i = 0; i < selectors.size(); i++) {
+        const char *sel = selectors[i].c_str();
+        if(strspn(sel, "0123456789") == selectors[i].size()) {
+            if(strtoul(sel, NULL, 10) == get_track_id(trak)) {
+                return true;
+            }
+        } else if(hdlr != NULL && hdlr->data_size >= 12 && memcmp(hdlr->data + 8, sel, 4) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool chunk_before(const chunk_t &a, const chunk_t &b) {
+    return a.offset < b.offset;
+}
+
+//Remove the selected tracks, and cut their chunks out of the media
+//data. Each removed trak and each run of removed chunks is recorded
+//as an edit, so the kept tracks' chunk offsets can follow; the mdat
+//boxes are rearranged to hold just the source ranges left in them.
+//Returns the number of tracks removed, or -1 if the file can't be
+//handled.
+int drop_tracks(atom_t *root, const std::vector<std::string> &selectors, std::vector<edit_t> &edits) {
+    atom_t *moov = find_box(root, "moov");
+    std::vector<chunk_t> dropped, kept;
+    std::vector<atom_t*> traks;
+    uint32_t i, j;
+    if(moov == NULL) {
+        printf("No moov box to drop tracks from\n");
+        return -1;
+    }
+    if(find_box(root, "moof") != NULL) {
+        printf("Can't drop tracks from a fragmented file\n");
+        return -1;
+    }
+    for(i = 0; i < moov->children.size(); i++) {
+        atom_t *trak = moov->children[i];
+        std::vector<chunk_t> chunks;
+        if(!trak->active || !is_box(trak, "trak")) {
+            continue;
+        }
+        if(get_track_chunks(trak, chunks) != 0) {
+            printf("Track %u has unreadable sample tables\n", get_track_id(trak));
+            return -1;
+        }
+        if(track_selected(trak, selectors)) {
+            traks.push_back(trak);
+            dropped.insert(dropped.end(), chunks.begin(), chunks.end());
+        } else {
+            kept.insert(kept.end(), chunks.begin(), chunks.end());
+        }
+    }
+
+    //Merge the dropped chunks into runs, and make sure none of them
+    //holds data a kept track still refers to.
+    std::sort(dropped.begin(), dropped.end(), chunk_before);
+    std::sort(kept.begin(), kept.end(), chunk_before);
+    std::vector<chunk_t> runs;
+    for(i = 0; i < dropped.size(); i++) {
+        if(dropped[i].size == 0) {
+            continue;
+        }
+        if(!runs.empty() && dropped[i].offset <= runs.back().offset + runs.back().size) {
+            uint64_t end = dropped[i].offset + dropped[i].size;
+            if(end > runs.back().offset + runs.back().size) {
+                runs.back().size = end - runs.back().offset;
+            }
+        } else {
+            runs.push_back(dropped[i]);
+        }
+    }
+    for(i = 0, j = 0; i < runs.size(); i++) {
+        while(j < kept.size() && kept[j].offset + kept[j].size <= runs[i].offset) {
+            j++;
+        }
+        if(j < kept.size() && kept[j].size > 0 && kept[j].offset < runs[i].offset + runs[i].size) {
+            printf("A dropped track shares media data with a kept one\n");
+            return -1;
+        }
+    }
+
+    //Cut the runs out of each mdat, keeping the ranges in between.
+    //Runs outside any mdat are left alone.
+    for(i = 0, j = 0; i < root->children.size(); i++) {
+        atom_t *mdat = root->children[i];
+        if(!mdat->deferred) {
+            continue;
+        }
+        uint64_t pos = mdat->offset + mdat->header_size;
+        uint64_t end = mdat->offset + mdat->len;
+        uint64_t removed = 0;
+        while(j < runs.size() && runs[j].offset < pos) {
+            j++;
+        }
+        for(; j < runs.size() && runs[j].offset + runs[j].size <= end; j++) {
+            piece_t piece = { pos, runs[j].offset - pos, false };
+            if(piece.size > 0) {
+                mdat->pieces.push_back(piece);
+            }
+            edit_t edit = { runs[j].offset, -(int64_t)runs[j].size };
+            edits.push_back(edit);
+            removed += runs[j].size;
+            pos = runs[j].offset + runs[j].size;
+        }
+        if(removed > 0) {
+            piece_t piece = { pos, end - pos, false };
+            if(piece.size > 0) {
+                mdat->pieces.push_back(piece);
+            }
+            mdat->rearranged = true;
+            mdat->len -= removed;
+            mdat->data_size -= removed;
+        }
+    }
+
+    for(i = 0; i < traks.size(); i++) {
+        edit_t edit = { traks[i]->offset, -(int64_t)traks[i]->len };
+        edits.push_back(edit);
+        traks[i]->active = false;
+        for(atom_t *cur = traks[i]->parent; cur != NULL; cur = cur->parent) {
+            cur->len -= traks[i]->len;
+        }
+    }
+    return traks.size();
+}
+
+//How the media data is laid out in the output. With align set, each
+//mdat payload starts at a multiple of align, and with align_chunks,
+//so does every chunk in it. sidx and mfra add random access indexes
+//to a fragmented file.
+typedef struct layout_t {
+    uint64_t align;
+    bool align_chunks;
+    bool sidx;
+    bool mfra;
+} layout_t;
+
+//Cut a run of zeros into a rearranged payload, ahead of the source byte
+//at offset.
+void insert_zeros(atom_t *mdat, uint64_t offset, uint64_t size) {
+    uint32_t i;
+    piece_t zeros = { 0, size, true };
+    for(i = 0; i < mdat->pieces.size(); i++) {
+        piece_t &piece = mdat->pieces[i];
+        if(piece.zeros || offset < piece.offset || offset >= piece.offset + piece.size) {
+            continue;
+        }
+        if(offset > piece.offset) {
+            piece_t rest = { offset, piece.offset + piece.size - offset, false };
+            piece.size = offset - piece.offset;
+            mdat->pieces.insert(mdat->pieces.begin() + i + 1, rest);
+            i++;
+        }
+        mdat->pieces.insert(mdat->pieces.begin() + i, zeros);
+        return;
+    }
+}
+
+//Pad the output as the layout asks. Padding ahead of an mdat goes in a
+//new free box; padding ahead of a chunk is a run of zeros inside the
+//mdat, which no sample refers to. Each is recorded as an edit that
+//inserts bytes, so the offsets move just as they do for removals.
+//Where the output will be depends on the edits made so far, so this
+//has to come after everything that removes boxes.
+//Returns 0, or -1 if a chunk offset would no longer fit in its stco.
+int align_media(atom_t *root, const layout_t *layout, std::vector<edit_t> &edits) {
+    std::vector<edit_t> removals(edits);
+    std::vector<chunk_t> chunks, narrow;
+    remap_t remap;
+    atom_t *moov = find_box(root, "moov");
+    uint64_t align = layout->align;
+    uint64_t extra = 0;
+    uint32_t i, j, k;
+    build_remap(removals, remap);
+
+    //The chunks still in the output, and the ones of those that are
+    //in 32-bit stco tables.
+    for(i = 0; moov != NULL && i < moov->children.size(); i++) {
+        atom_t *trak = moov->children[i];
+        std::vector<chunk_t> track_chunks;
+        if(!trak->active || !is_box(trak, "trak") ||
+           get_track_chunks(trak, track_chunks) != 0) {
+            continue;
+        }
+        chunks.insert(chunks.end(), track_chunks.begin(), track_chunks.end());
+        if(find_box(trak, "mdia/minf/stbl/stco") != NULL) {
+            narrow.insert(narrow.end(), track_chunks.begin(), track_chunks.end());
+        }
+    }
+    std::sort(chunks.begin(), chunks.end(), chunk_before);
+
+    for(i = 0, j = 0; i < root->children.size(); i++) {
+        atom_t *mdat = root->children[i];
+        if(!mdat->deferred || !mdat->active) {
+            continue;
+        }
+        uint64_t payload = mdat->offset + mdat->header_size;
+        uint64_t end = mdat->offset + mdat->len;
+        if(mdat->rearranged) {
+            end = payload;
+            for(k = 0; k < mdat->pieces.size(); k++) {
+                if(!mdat->pieces[k].zeros) {
+                    end = mdat->pieces[k].offset + mdat->pieces[k].size;
+                }
+            }
+        }
+
+        //A free box can't be shorter than its header
+        uint64_t out = remap_offset(remap, mdat->offset) + extra + mdat->header_size;
+        uint64_t pad = (align - out % align) % align;
+        if(pad > 0 && pad < 8) {
+            pad += align;
+        }
+        if(pad > 0) {
+            atom_t *free_box = (atom_t*)calloc(sizeof(atom_t), 1);
+            free_box->parent = root;
+            free_box->offset = mdat->offset;
+            free_box->len = pad;
+            free_box->header_size = 8;
+            memcpy(free_box->name, "free", 4);
+            free_box->data_size = pad - 8;
+            free_box->active = true;
+            root->children.insert(root->children.begin() + i, free_box);
+            i++;
+            edit_t edit = { mdat->offset, (int64_t)pad };
+            edits.push_back(edit);
+            extra += pad;
+        }
+
+        for(; layout->align_chunks && j < chunks.size(); j++) {
+            const chunk_t &chunk = chunks[j];
+            if(chunk.offset < payload) {
+                continue;
+            }
+            if(chunk.offset >= end) {
+                break;
+            }
+            out = remap_offset(remap, chunk.offset) + extra;
+            pad = (align - out % align) % align;
+            if(pad == 0) {
+                continue;
+            }
+            if(!mdat->rearranged) {
+                piece_t all = { payload, mdat->data_size, false };
+                mdat->pieces.push_back(all);
+                mdat->rearranged = true;
+            }
+            insert_zeros(mdat, chunk.offset, pad);
+            mdat->len += pad;
+            mdat->data_size += pad;
+            edit_t edit = { chunk.offset, (int64_t)pad };
+            edits.push_back(edit);
+            extra += pad;
+        }
+    }
+
+    build_remap(edits, remap);
+    for(i = 0; i < narrow.size(); i++) {
+        if(remap_offset(remap, narrow[i].offset + narrow[i].size) > UINT32_MAX) {
+            printf("Aligned chunk offsets no longer fit in an stco table\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* A fragmented file has a moov with no samples in it, followed by any
+ * number of fragments: a moof holding the sample tables for the mdat
+ * after it. To seek, a player has to find the right fragment, which
+ * without an index means reading every moof from the start. --sidx puts
+ * a segment index ahead of the first fragment, giving the size, start
+ * time and duration of each; --mfra puts a random access box at the end,
+ * listing the time and moof offset of the first sync sample in each
+ * fragment, track by track. An index of the same kind already in the
+ * file is replaced. Both are worked out from the moof boxes alone, which
+ * the tree holds already; the media data is never read.
+ *
+ * The sidx goes in as an edit like any other, so everything after it
+ * moves and has its offsets rebased along with the rest. Its own fields
+ * are all relative (sizes, and the gap to the first fragment), and are
+ * filled in once the layout is final. The mfra goes at the very end,
+ * where it moves nothing, and is made last, from where each moof ended
+ * up.
+ */
+#define SAMPLE_NON_SYNC 0x00010000
+
+//A track fragment's first sync sample: when it is, which fragment it's
+//in, and where it is in that fragment's moof.
+typedef struct tfra_entry_t {
+    uint64_t time;
+    uint32_t fragment;
+    uint32_t traf_number;
+    uint32_t trun_number;
+    uint32_t sample_number;
+} tfra_entry_t;
+
+typedef struct frag_track_t {
+    uint32_t id;
+    uint32_t timescale;
+    //The trex defaults
+    uint32_t duration;
+    uint32_t flags;
+    //The decode time at the end of the last track fragment read
+    uint64_t next_time;
+    std::vector<tfra_entry_t> entries;
+} frag_track_t;
+
+//A fragment, as the sidx describes it: from its reference track's
+//first sample, for the length of that track's samples.
+typedef struct fragment_t {
+    atom_t *moof;
+    uint64_t time;
+    uint64_t duration;
+    bool sync;
+} fragment_t;
+
+typedef struct fragment_index_t {
+    std::vector<frag_track_t> tracks;
+    uint32_t reference;
+    std::vector<fragment_t> fragments;
+    atom_t *sidx;
+    bool sidx_v1;
+} fragment_index_t;
+
+//Read the tracks and their trex defaults. The sidx describes the first
+//video track, or the first track if there isn't one.
+//Returns -1 if the file isn't fragmented.
+int get_fragment_tracks(atom_t *root, fragment_index_t *index) {
+    atom_t *moov = find_box(root, "moov");
+    atom_t *mvex = find_box(root, "moov/mvex");
+    std::vector<std::string> video(1, "vide");
+    uint32_t i, j;
+    bool found = false;
+    if(moov == NULL || mvex == NULL) {
+        return -1;
+    }
+    index->reference = 0;
+    for(i = 0; i < moov->children.size(); i++) {
+        atom_t *trak = moov->children[i];
+        atom_t *mdhd = find_box(trak, "mdia/mdhd");
+        if(!is_box(trak, "trak")) {
+            continue;
+        }
+        frag_track_t track;
+        track.id = get_track_id(trak);
+        track.timescale = 0;
+        if(mdhd != NULL && mdhd->data_size >= 24) {
+            track.timescale = get_be32(mdhd->data + (mdhd->data[0] == 1 && mdhd->data_size >= 36 ? 20 : 12));
+        }
+        track.duration = 0;
+        track.flags = 0;
+        track.next_time = 0;
+        for(j = 0; j < mvex->children.size(); j++) {
+            atom_t *trex = mvex->children[j];
+            if(is_box(trex, "trex") && trex->data_size >= 24 &&
+               get_be32(trex->data + 4) == track.id) {
+                track.duration = get_be32(trex->data + 12);
+                track.flags = get_be32(trex->data + 20);
+            }
+        }
+        if(!found && track_selected(trak, video)) {
+            index->reference = index->tracks.size();
+            found = true;
+        }
+        index->tracks.push_back(track);
+    }
+    return index->tracks.empty() ? -1 : 0;
+}
+
+//Walk the samples of a track fragment, to find when it starts, how long
+//it lasts, and where its first sync sample is, which is noted in the
+//track's random access entries.
+//Returns 0, or -1 if its headers can't be read.
+int scan_traf(atom_t *traf, uint32_t fragment, uint32_t traf_number, frag_track_t *track,
+              fragment_t *frag) {
+    atom_t *tfhd = find_box(traf, "tfhd");
+    atom_t *tfdt = find_box(traf, "tfdt");
+    uint32_t i, j, trun_number = 0;
+    bool first = true, found = false;
+    if(tfhd == NULL || tfhd->data_size < 8) {
+        return -1;
+    }
+
+    //The optional tfhd fields are the base data offset, the sample
+    //description index, and the default duration, size and flags
+    uint32_t flags = get_be32(tfhd->data);
+    uint32_t duration = track->duration;
+    uint32_t sample_flags = track->flags;
+    const unsigned char *p = tfhd->data + 8;
+    const unsigned char *end = tfhd->data + tfhd->data_size;
+    p += flags & 0x01 ? 8 : 0;
+    p += flags & 0x02 ? 4 : 0;
+    if(flags & 0x08) {
+        duration = p + 4 <= end ? get_be32(p) : 0;
+        p += 4;
+    }
+    p += flags & 0x10 ? 4 : 0;
+    if(flags & 0x20) {
+        sample_flags = p + 4 <= end ? get_be32(p) : 0;
+        p += 4;
+    }
+    if(p > end) {
+        return -1;
+    }
+
+    uint64_t t = track->next_time;
+    if(tfdt != NULL && tfdt->data_size >= (tfdt->data[0] == 1 ? 12 : 8)) {
+        t = tfdt->data[0] == 1 ? get_be64(tfdt->data + 4) : get_be32(tfdt->data + 4);
+    }
+    frag->time = t;
+    frag->duration = 0;
+    frag->sync = false;
+    for(i = 0; i < traf->children.size(); i++) {
+        atom_t *trun = traf->children[i];
+        if(!is_box(trun, "trun")) {
+            continue;
+        }
+        trun_number++;
+        if(trun->data_size < 8) {
+            return -1;
+        }
+        //A data offset, and flags for the first sample, may come ahead
+        //of the samples; each sample has a duration, size, flags and
+        //composition offset, each only if the trun's flags say so.
+        uint32_t run_flags = get_be32(trun->data);
+        uint32_t count = get_be32(trun->data + 4);
+        size_t at = 8 + (run_flags & 0x001 ? 4 : 0);
+        uint32_t first_flags = sample_flags;
+        if(run_flags & 0x004) {
+            if(at + 4 > trun->data_size) {
+                return -1;
+            }
+            first_flags = get_be32(trun->data + at);
+            at += 4;
+        }
+        size_t stride = 4 * (((run_flags >> 8) & 1) + ((run_flags >> 9) & 1) +
+                             ((run_flags >> 10) & 1) + ((run_flags >> 11) & 1));
+        if(at + (uint64_t)stride * count > trun->data_size) {
+            return -1;
+        }
+        for(j = 0; j < count; j++, at += stride) {
+            const unsigned char *q = trun->data + at;
+            uint32_t d = duration;
+            uint32_t f = j == 0 ? first_flags : sample_flags;
+            int64_t offset = 0;
+            if(run_flags & 0x100) {
+                d = get_be32(q);
+                q += 4;
+            }
+            q += run_flags & 0x200 ? 4 : 0;
+            if(run_flags & 0x400) {
+                f = j == 0 && (run_flags & 0x004) ? first_flags : get_be32(q);
+                q += 4;
+            }
+            if(run_flags & 0x800) {
+                offset = trun->data[0] == 1 ? (int64_t)(int32_t)get_be32(q) : get_be32(q);
+            }
+            //Times are presentation times: the decode time plus the
+            //composition offset
+            if(first) {
+                frag->time = t + offset;
+                frag->sync = !(f & SAMPLE_NON_SYNC);
+                first = false;
+            }
+            if(!found && !(f & SAMPLE_NON_SYNC)) {
+                tfra_entry_t entry = { t + offset, fragment, traf_number, trun_number, j + 1 };
+                track->entries.push_back(entry);
+                found = true;
+            }
+            t += d;
+            frag->duration += d;
+        }
+    }
+    track->next_time = t;
+    return 0;
+}
+
+//Read every fragment's moof, and get the indexes ready: the old ones are
+//removed, and a sidx of the right size is put in ahead of the first
+//fragment, to be filled in by finish_fragment_index.
+//Returns 0, or -1 if the file isn't fragmented or a moof can't be read.
+int index_fragments(atom_t *root, const layout_t *layout, fragment_index_t *index,
+                    std::vector<edit_t> &edits) {
+    uint32_t i, j, k;
+    int first_moof = -1;
+    if(get_fragment_tracks(root, index) != 0) {
+        printf("--sidx and --mfra need a fragmented file\n");
+        return -1;
+    }
+    for(i = 0; i < root->children.size(); i++) {
+        atom_t *atom = root->children[i];
+        if(!atom->active) {
+            continue;
+        }
+        if((layout->sidx && is_box(atom, "sidx")) ||
+           (layout->mfra && is_box(atom, "mfra"))) {
+            edit_t edit = { atom->offset, -(int64_t)atom->len };
+            edits.push_back(edit);
+            atom->active = false;
+            continue;
+        }
+        if(!is_box(atom, "moof")) {
+            continue;
+        }
+        if(first_moof < 0) {
+            first_moof = i;
+        }
+        fragment_t frag = { atom, 0, 0, false };
+        bool described = false;
+        for(j = 0, k = 0; j < atom->children.size(); j++) {
+            atom_t *traf = atom->children[j];
+            atom_t *tfhd = find_box(traf, "tfhd");
+            if(!is_box(traf, "traf")) {
+                continue;
+            }
+            k++;
+            uint32_t id = tfhd != NULL && tfhd->data_size >= 8 ? get_be32(tfhd->data + 4) : 0;
+            uint32_t t = 0;
+            while(t < index->tracks.size() && index->tracks[t].id != id) {
+                t++;
+            }
+            fragment_t traf_frag;
+            if(t == index->tracks.size() ||
+               scan_traf(traf, index->fragments.size(), k, &index->tracks[t], &traf_frag) != 0) {
+                printf("Could not read the track fragment headers in the moof at %llu\n",
+                       (unsigned long long)atom->offset);
+                return -1;
+            }
+            if(t != index->reference) {
+                continue;
+            }
+            if(!described) {
+                frag.time = traf_frag.time;
+                frag.sync = traf_frag.sync;
+                described = true;
+            }
+            frag.duration += traf_frag.duration;
+        }
+        if(!described) {
+            frag.time = index->tracks[index->reference].next_time;
+        }
+        index->fragments.push_back(frag);
+    }
+    if(first_moof < 0) {
+        printf("--sidx and --mfra need a fragmented file\n");
+        return -1;
+    }
+    printf("Indexing %zu fragments\n", index->fragments.size());
+    index->sidx = NULL;
+    if(!layout->sidx) {
+        return 0;
+    }
+    if(index->fragments.size() > UINT16_MAX) {
+        printf("Too many fragments for one sidx\n");
+        return -1;
+    }
+
+    //The sidx is the same size whatever goes in it, so it can be put in
+    //now; it needs 64-bit fields only if the first time doesn't fit in 32
+    index->sidx_v1 = index->fragments[0].time > UINT32_MAX;
+    atom_t *moof = root->children[first_moof];
+    atom_t *sidx = (atom_t*)calloc(sizeof(atom_t), 1);
+    sidx->parent = root;
+    sidx->offset = moof->offset;
+    sidx->header_size = 8;
+    memcpy(sidx->name, "sidx", 4);
+    sidx->data_size = 16 + (index->sidx_v1 ? 16 : 8) + 12 * index->fragments.size();
+    sidx->len = sidx->header_size + sidx->data_size;
+    sidx->active = true;
+    root->children.insert(root->children.begin() + first_moof, sidx);
+    index->sidx = sidx;
+    edit_t edit = { moof->offset, (int64_t)sidx->len };
+    edits.push_back(edit);
+    return 0;
+}
+
+//Copy a box made in memory into an atom's payload.
+void set_box_data(atom_t *atom, const std::string &box) {
+    free(atom->data);
+    atom->data_size = box.size() - 8;
+    atom->data = (unsigned char*)malloc(atom->data_size);
+    memcpy(atom->data, box.data() + 8, atom->data_size);
+}
+
+//With the layout final, fill in the sidx and add the mfra.
+//Returns 0, or -1 if a fragment is too big for the sidx to describe.
+int finish_fragment_index(atom_t *root, const layout_t *layout, fragment_index_t *index) {
+    std::vector<uint64_t> moof_offsets;
+    uint64_t pos = 0, end = 0;
+    uint32_t i, j;
+    atom_t *last = NULL;
+
+    //Where each moof starts in the output, and where the media data
+    //of the last fragment ends
+    for(i = 0, j = 0; i < root->children.size(); i++) {
+        atom_t *atom = root->children[i];
+        if(!atom->active) {
+            continue;
+        }
+        if(j < index->fragments.size() && atom == index->fragments[j].moof) {
+            moof_offsets.push_back(pos);
+            j++;
+        }
+        pos += atom->len;
+        if(j > 0 && atom->deferred) {
+            end = pos;
+        }
+        last = atom;
+    }
+
+    if(layout->sidx) {
+        const frag_track_t &track = index->tracks[index->reference];
+        std::string p;
+        append_be32(p, track.id);
+        append_be32(p, track.timescale);
+        if(index->sidx_v1) {
+            append_be64(p, index->fragments[0].time);
+            append_be64(p, 0);
+        } else {
+            append_be32(p, index->fragments[0].time);
+            append_be32(p, 0);
+        }
+        append_be16(p, 0);
+        append_be16(p, index->fragments.size());
+        for(i = 0; i < index->fragments.size(); i++) {
+            const fragment_t &frag = index->fragments[i];
+            uint64_t next = i + 1 < moof_offsets.size() ? moof_offsets[i + 1] : end;
+            uint64_t size = next > moof_offsets[i] ? next - moof_offsets[i] : 0;
+            if(size > 0x7fffffff || frag.duration > UINT32_MAX) {
+                printf("The fragment at %llu is too big for a sidx to describe\n",
+                       (unsigned long long)moof_offsets[i]);
+                return -1;
+            }
+            //A fragment starting with a sync sample starts with a
+            //stream access point of type 1
+            append_be32(p, size);
+            append_be32(p, frag.duration);
+            append_be32(p, frag.sync ? 0x90000000 : 0);
+        }
+        set_box_data(index->sidx, make_full_box("sidx", index->sidx_v1 ? 1 << 24 : 0, p));
+    }
+
+    if(layout->mfra) {
+        std::string tfras;
+        for(i = 0; i < index->tracks.size(); i++) {
+            const frag_track_t &track = index->tracks[i];
+            std::string p;
+            if(track.entries.empty()) {
+                continue;
+            }
+            //64-bit times and offsets, and 32-bit numbers
+            append_be32(p, track.id);
+            append_be32(p, 0x3f);
+            append_be32(p, track.entries.size());
+            for(j = 0; j < track.entries.size(); j++) {
+                const tfra_entry_t &entry = track.entries[j];
+                append_be64(p, entry.time);
+                append_be64(p, moof_offsets[entry.fragment]);
+                append_be32(p, entry.traf_number);
+                append_be32(p, entry.trun_number);
+                append_be32(p, entry.sample_number);
+            }
+            tfras += make_full_box("tfra", 1 << 24, p);
+        }
+        std::string p;
+        append_be32(p, tfras.size() + 8 + 16);
+        std::string mfra = make_box("mfra", tfras + make_full_box("mfro", 0, p));
+
+        //A box that ran to the end of the file doesn't any more
+        if(last != NULL && last->to_end) {
+            if(last->header_size != 8 || last->len > UINT32_MAX) {
+                printf("Can't add an mfra after a %s box that runs to the end of the file\n",
+                       last->name);
+                return -1;
+            }
+            last->to_end = false;
+        }
+        atom_t *atom = (atom_t*)calloc(sizeof(atom_t), 1);
+        atom->parent = root;
+        atom->offset = last != NULL ? last->offset + last->len : 0;
+        atom->header_size = 8;
+        memcpy(atom->name, "mfra", 4);
+        atom->len = mfra.size();
+        atom->active = true;
+        set_box_data(atom, mfra);
+        root->children.push_back(atom);
+    }
+    return 0;
+}
+
+//Strip all meta boxes, lay out the media data, index the fragments if
+//asked, and fix up the offsets that moved, taking into account any
+//other edits already made to the tree. layout may be NULL to leave the
+//media data as it is.
+//Returns 0, or -1 if the layout can't be done.
+int strip_boxes(atom_t *node, std::vector<edit_t> &edits, const layout_t *layout) {
+    std::vector<atom_t*> offset_boxes;
+    fragment_index_t index;
+    remap_t remap;
+    bool indexed = layout != NULL && (layout->sidx || layout->mfra);
+    if(indexed && index_fragments(node, layout, &index, edits) != 0) {
+        return -1;
+    }
+    strip_meta_box_rec(node, edits, offset_boxes);
+    if(layout != NULL && layout->align > 0 && align_media(node, layout, edits) != 0) {
+        return -1;
+    }
+    build_remap(edits, remap);
+    adjust_offsets(offset_boxes, remap);
+    if(indexed && finish_fragment_index(node, layout, &index) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+//Strip meta boxes without rewriting the file: each meta box
+//is relabeled as a free box of the same size, so no other box
+//moves and no offsets need adjusting. The old payload is then
+//punched out, along with that of any padding already in the
+//file, so the space is released immediately and nothing has
+//to be written over it.
+//Returns the number of payload bytes punched, or -1 on error.
+int64_t strip_meta_in_place(atom_t *node, int fd) {
+    uint32_t i;
+    int64_t released = 0;
+    if(is_metadata_box(node)) {
+        if(pwrite(fd, "free", 4, node->offset + 4) != 4) {
+            return -1;
+        }
+        memcpy(node->name, "free", 4);
+    }
+    if(node->parent != NULL && is_padding_box(node->name)) {
+        if(punch_hole(fd, node->offset + node->header_size, node->data_size) != 0) {
+            return -1;
+        }
+        return node->data_size;
+    }
+    for(i = 0; i < node->children.size(); i++) {
+        check_cancel();
+        int64_t r = strip_meta_in_place(node->children[i], fd);
+        if(r < 0) {
+            return -1;
+        }
+        released += r;
+    }
+    return released;
+}
+
+
+//Read one top-level atom into the tree under root, along with all
+//of the atoms nested inside it. If the atom is marked as a container,
+//move through the data section of the atom sub-atom at a time,
+//otherwise just dump the whole data thing into a blob.
+//Returns the top-level atom, or NULL when there are no more atoms.
+//The payload of a deferred atom is left unread in the source.
+atom_t* read_box_tree(source_t* src, atom_t *root) {
+
+    //Place to hold the current working atom.
+    atom_t *atom;
+    atom_t *top = NULL;
+
+    atom_t *current_parent = root;
+
+    /* Loop through the atoms until we're back at the top level */
+    while((atom = current_parent != root && current_parent->data_remaining < 8 ?
+                  get_filler(src, current_parent->data_remaining) : get_next_box(src))->len > 0) {
+        //Set the parent of the newly created atom
+        atom->parent = current_parent; 
+        if(top == NULL) {
+            top = atom;
+        }
+
+        //Add new atom to the current parent list.
+        current_parent->children.push_back(atom);
+
+        //Subtract size of current atom from
+        //the data_remaining of the parent
+        //Note: this must occur before the next step
+        //which might change the level. Don't try to
+        //include it in the following step.
+        if(current_parent != root) {
+            current_parent->data_remaining -= atom->len;
+        }
+
+        //If the atom has data_remaining set, then must have some children
+        if(atom->data_remaining > 0) {
+            current_parent = atom;
+        }
+
+        //Check if we have data remaining in the parent.
+        //If not, if atom was the last one in the parent.
+        //So, move back up one level
+        if(current_parent != root) {
+            //Make sure we haven't overrun any expected sizes in the parent 
+            if(current_parent->data_remaining < 0) {
+                printf("Something wrong: child atom overruns the parent size.");
+                printf("Parent name is: %s\n",current_parent->name);
+                exit(1);
+            } 
+
+            //We're done getting the children of this parent, move back up.
+            while (current_parent && current_parent->parent && current_parent->data_remaining == 0) {
+                current_parent = current_parent->parent;
+            }
+        }
+        if(current_parent == root) {
+            return top;
+        }
+    }
+    free_tree(atom);
+    
+    return top;
+}
+
+//Create a representation of the tree structure of the atoms
+//in a seekable source, skipping over deferred payloads.
+atom_t* build_tree(source_t* src) {
+    atom_t *atom;
+
+    //Create an abstract root node to hold the top-level
+    //atom list.
+    atom_t *root = (atom_t*)calloc(sizeof(atom_t), 1);
+
+    while((atom = read_box_tree(src, root)) != NULL) {
+        if(atom->deferred) {
+            source_seek(src, atom->offset + atom->len);
+        }
+    }
+    return root;
+}
+
+//Remove meta boxes from a stream that can only be read once, such as a
+//pipe or a member of a tar archive, and write the result to out.
+//
+//Top-level boxes are held in memory until the first deferred (mdat) box
+//turns up. By then every meta box ahead of the media data is known, so
+//they're stripped and the chunk offsets adjusted just as for a file. From
+//then on, nothing ahead of media data may change size: chunk offsets in
+//an already written moov can't be fixed up. A meta box between two
+//deferred boxes is turned into a free box of the same size instead, with
+//its payload zeroed.
+//
+//Boxes after the media data (a moov at the end, as cameras write it) are
+//held back too, until the end shows nothing follows them; then their
+//meta boxes are stripped like the leading ones. That's only done without
+//on_size, though: with it, the output length has been committed, so
+//they're blanked as they come.
+//
+//If the source's length is known, on_size is called with the length of the
+//output just before anything is written. Returns the number of bytes
+//of meta boxes removed.
+uint64_t strip_stream(source_t *src, FILE *out,
+                      void (*on_size)(uint64_t out_size, void *ctx), void *ctx) {
+    atom_t *root = (atom_t*)calloc(sizeof(atom_t), 1);
+    atom_t *atom;
+    std::vector<atom_t*> offset_boxes;
+    std::vector<edit_t> edits;
+    remap_t remap;
+    uint64_t removed = 0;
+    bool flushed = false;
+    uint32_t i;
+
+    while(true) {
+        atom = read_box_tree(src, root);
+        bool flush = flushed && (on_size != NULL || atom == NULL || atom->deferred);
+        if(!flushed && (atom == NULL || atom->deferred)) {
+            strip_meta_box_rec(root, edits, offset_boxes);
+            build_remap(edits, remap);
+            removed = -remap.shift.back();
+            if(on_size != NULL && src->limit != SOURCE_UNBOUNDED) {
+                on_size(src->limit - removed, ctx);
+            }
+            flushed = flush = true;
+        } else if(flushed && on_size != NULL && atom != NULL) {
+            blank_meta_box_rec(atom, offset_boxes);
+        } else if(flushed && atom != NULL && atom->deferred) {
+            //More media data: the boxes held back can't change size
+            for(i = 0; i < root->children.size(); i++) {
+                blank_meta_box_rec(root->children[i], offset_boxes);
+            }
+        } else if(flushed && atom == NULL) {
+            //Nothing comes after the boxes held back
+            for(i = 0; i < root->children.size(); i++) {
+                strip_meta_box_rec(root->children[i], edits, offset_boxes);
+            }
+            build_remap(edits, remap);
+            removed = -remap.shift.back();
+        }
+        adjust_offsets(offset_boxes, remap);
+        offset_boxes.clear();
+        if(flush) {
+            output_tree(root, out, src);
+            for(i = 0; i < root->children.size(); i++) {
+                free_tree(root->children[i]);
+            }
+            root->children.clear();
+        }
+        if(atom == NULL) {
+            break;
+        }
+    }
+
+    //Anything after the last box is passed through untouched
+    if(src->limit != SOURCE_UNBOUNDED) {
+        source_copy(src, src->pos, src->limit - src->pos, out);
+    } else {
+        unsigned char buf[65536];
+        size_t n;
+        while((n = source_read(src, buf, sizeof(buf))) > 0) {
+            fwrite(buf, 1, n, out);
+        }
+    }
+    free_tree(root);
+    return removed;
+}
+
+/* Tar archives are a sequence of 512-byte header blocks, each followed
+ * by the member's data padded out to a whole block. The MPEG-4 members
+ * are stripped as they stream past, so the only thing that has to be
+ * held in memory is the part of a member ahead of its media data.
+ *
+ * The member size is recorded in the header, ahead of the data, so it
+ * has to be corrected before the member is written. strip_stream tells
+ * us the new size once it's known, and the header goes out then.
+ */
+#define TAR_BLOCK 512
+
+typedef struct tar_member_t {
+    unsigned char header[TAR_BLOCK];
+    //pax extended headers and GNU long names that apply to this
+    //member, held back until we know the member's new size
+    std::vector<unsigned char> ext;
+    //Where in ext the pax header carrying a size record starts, if any
+    size_t pax_size_at;
+    bool pax_size;
+    FILE *out;
+} tar_member_t;
+
+uint64_t tar_get_number(const unsigned char *field, size_t len) {
+    uint64_t value = 0;
+    size_t i;
+    //GNU base-256 encoding, for values too large for octal
+    if(field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for(i = 1; i < len; i++) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+    for(i = 0; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+void tar_set_number(unsigned char *field, size_t len, uint64_t value) {
+    size_t i;
+    if(value >> (3 * (len - 1)) == 0) {
+        snprintf((char*)field, len, "%0*llo", (int)len - 1, (unsigned long long)value);
+        return;
+    }
+    memset(field, 0, len);
+    field[0] = 0x80;
+    for(i = len - 1; i > 0 && value != 0; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+void tar_set_checksum(unsigned char *header) {
+    uint32_t sum = 0;
+    int i;
+    memset(header + 148, ' ', 8);
+    for(i = 0; i < TAR_BLOCK; i++) {
+        sum += header[i];
+    }
+    snprintf((char*)header + 148, 7, "%06o", sum);
+    header[155] = ' ';
+}
+
+//Rewrite the size record in a pax extended header. Each record is
+//"<length> <key>=<value>\n", where the length counts itself.
+void tar_set_pax_size(std::string &records, uint64_t size) {
+    std::string result;
+    size_t pos = 0;
+    while(pos < records.size()) {
+        size_t len = strtoull(records.c_str() + pos, NULL, 10);
+        if(len == 0 || pos + len > records.size()) {
+            break;
+        }
+        std::string record = records.substr(pos, len);
+        size_t space = record.find(' ');
+        if(space != std::string::npos && record.compare(space + 1, 5, "size=") == 0) {
+            char body[64];
+            snprintf(body, sizeof(body), " size=%llu\n", (unsigned long long)size);
+            size_t total = strlen(body);
+            while(total != strlen(body) + snprintf(NULL, 0, "%zu", total)) {
+                total = strlen(body) + snprintf(NULL, 0, "%zu", total);
+            }
+            char prefix[32];
+            snprintf(prefix, sizeof(prefix), "%zu", total);
+            record = std::string(prefix) + body;
+        }
+        result += record;
+        pos += len;
+    }
+    records = result;
+}
+
+//Look up a record in a pax extended header.
+bool tar_get_pax(const std::string &records, const char *key, std::string &value) {
+    size_t pos = 0;
+    size_t key_len = strlen(key);
+    while(pos < records.size()) {
+        size_t len = strtoull(records.c_str() + pos, NULL, 10);
+        if(len == 0 || pos + len > records.size()) {
+            break;
+        }
+        size_t space = records.find(' ', pos);
+        if(space < pos + len && records.compare(space + 1, key_len, key) == 0 &&
+           records[space + 1 + key_len] == '=') {
+            value = records.substr(space + 2 + key_len, pos + len - space - 3 - key_len);
+            return true;
+        }
+        pos += len;
+    }
+    return false;
+}
+
+void tar_write_padding(FILE *out, uint64_t size) {
+    write_zeros(out, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+//Write out the held-back extension headers and the member header,
+//now that the member's output size is known.
+void tar_write_member_header(uint64_t out_size, void *ctx) {
+    tar_member_t *member = (tar_member_t*)ctx;
+    size_t ext_end = member->ext.size();
+    if(member->pax_size) {
+        //The pax header's records follow its header block
+        unsigned char *pax = &member->ext[member->pax_size_at];
+        uint64_t len = tar_get_number(pax + 124, 12);
+        uint64_t padded = len + (TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK;
+        std::string records((char*)pax + TAR_BLOCK, len);
+        tar_set_pax_size(records, out_size);
+
+        unsigned char pax_header[TAR_BLOCK];
+        memcpy(pax_header, pax, TAR_BLOCK);
+        tar_set_number(pax_header + 124, 12, records.size());
+        tar_set_checksum(pax_header);
+        fwrite(&member->ext[0], 1, member->pax_size_at, member->out);
+        fwrite(pax_header, 1, TAR_BLOCK, member->out);
+        fwrite(records.data(), 1, records.size(), member->out);
+        tar_write_padding(member->out, records.size());
+        size_t rest = member->pax_size_at + TAR_BLOCK + padded;
+        fwrite(&member->ext[0] + rest, 1, ext_end - rest, member->out);
+    } else if(ext_end > 0) {
+        fwrite(&member->ext[0], 1, ext_end, member->out);
+    }
+    tar_set_number(member->header + 124, 12, out_size);
+    tar_set_checksum(member->header);
+    fwrite(member->header, 1, TAR_BLOCK, member->out);
+}
+
+bool is_mpeg4_name(const std::string &name) {
+    const char *extensions[] = { ".mp4", ".m4a", ".m4v", ".m4b", ".m4p", ".mov" };
+    size_t i;
+    for(i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        size_t len = strlen(extensions[i]);
+        if(name.size() > len &&
+           strcasecmp(name.c_str() + name.size() - len, extensions[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Copy a tar archive from in to out, stripping the meta boxes from
+//every MPEG-4 member on the way through. Progress goes to report.
+int strip_tar(FILE *in, FILE *out, FILE *report) {
+    tar_member_t member;
+    member.out = out;
+    member.pax_size = false;
+    member.pax_size_at = 0;
+    std::string path;
+    unsigned char header[TAR_BLOCK];
+    static const unsigned char zero_block[TAR_BLOCK] = {0};
+    uint64_t pax_size = 0;
+
+    while(fread(header, 1, TAR_BLOCK, in) == TAR_BLOCK) {
+        if(memcmp(header, zero_block, TAR_BLOCK) == 0) {
+            break;
+        }
+        uint64_t size = tar_get_number(header + 124, 12);
+        uint64_t padded = size + (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+        char type = header[156];
+        source_t src = source_from_stream(in, padded);
+
+        if(type == 'x' || type == 'L') {
+            //Extension headers apply to the next member, so hold them back
+            size_t start = member.ext.size();
+            member.ext.insert(member.ext.end(), header, header + TAR_BLOCK);
+            member.ext.resize(start + TAR_BLOCK + padded);
+            if(source_read(&src, &member.ext[start + TAR_BLOCK], padded) != padded) {
+                fprintf(report, "Archive is truncated\n");
+                return -1;
+            }
+            std::string records((char*)&member.ext[start + TAR_BLOCK], size);
+            std::string value;
+            if(type == 'L') {
+                path = std::string(records.c_str());
+            } else {
+                if(tar_get_pax(records, "path", value)) {
+                    path = value;
+                }
+                if(tar_get_pax(records, "size", value)) {
+                    pax_size = strtoull(value.c_str(), NULL, 10);
+                    member.pax_size = true;
+                    member.pax_size_at = start;
+                }
+            }
+            continue;
+        }
+
+        if(path.empty()) {
+            char prefix[156], base[101];
+            memcpy(prefix, header + 345, 155);
+            prefix[155] = 0;
+            memcpy(base, header, 100);
+            base[100] = 0;
+            path = prefix[0] ? std::string(prefix) + "/" + base : std::string(base);
+        }
+        if(member.pax_size) {
+            size = pax_size;
+            padded = size + (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+            src = source_from_stream(in, padded);
+        }
+
+        memcpy(member.header, header, TAR_BLOCK);
+        if((type == '0' || type == '\0') && is_mpeg4_name(path)) {
+            src.limit = size;
+            uint64_t removed = strip_stream(&src, out, tar_write_member_header, &member);
+            tar_write_padding(out, size - removed);
+            fprintf(report, "%s: removed %llu bytes\n", path.c_str(), (unsigned long long)removed);
+            //Drop the input's padding; ours has been written
+            src.limit = padded;
+            if(source_seek(&src, padded) != 0) {
+                fprintf(report, "%s: archive is truncated\n", path.c_str());
+                return -1;
+            }
+        } else {
+            tar_write_member_header(size, &member);
+            if(source_copy(&src, 0, padded, out) != 0) {
+                fprintf(report, "%s: archive is truncated\n", path.c_str());
+                return -1;
+            }
+        }
+        member.ext.clear();
+        member.pax_size = false;
+        path.clear();
+    }
+
+    //A header read cut short by a signal looks like the end
+    check_cancel();
+
+    //End of archive marker
+    write_zeros(out, 2 * TAR_BLOCK);
+    fflush(out);
+    return 0;
+}
+
+/* A virtual stripped file reads as the output of output_tree would, without
+ * writing it anywhere. The output is described as a sorted list of extents,
+ * each either box header bytes, box data held in memory, a range of the
+ * source (deferred payloads) or zeros (padding), and reads are served from
+ * those with pread on the source file.
+ */
+enum extent_kind_t {
+    EXTENT_HEADER,
+    EXTENT_MEMORY,
+    EXTENT_SOURCE,
+    EXTENT_ZEROS
+};
+
+typedef struct extent_t {
+    uint64_t start;     //offset in the stripped file
+    uint64_t len;
+    extent_kind_t kind;
+    const unsigned char *data;  //EXTENT_MEMORY
+    uint64_t src_offset;        //EXTENT_SOURCE
+    unsigned char header[16];   //EXTENT_HEADER
+} extent_t;
+
+typedef struct vfile_t {
+    int fd;
+    atom_t *tree;
+    std::vector<extent_t> extents;
+    uint64_t size;
+} vfile_t;
+
+void vfile_add_extent(vfile_t *vf, extent_t ext) {
+    if(ext.len == 0) {
+        return;
+    }
+    ext.start = vf->size;
+    vf->extents.push_back(ext);
+    vf->size += ext.len;
+}
+
+//Mirrors output_tree, one extent per write.
+void vfile_add_tree(vfile_t *vf, atom_t *node) {
+    uint32_t i;
+    if(node->parent != NULL) {
+        extent_t ext;
+        memset(&ext, 0, sizeof(ext));
+        ext.kind = EXTENT_HEADER;
+        ext.len = node->header_size;
+        put_box_header(node, ext.header);
+        vfile_add_extent(vf, ext);
+
+        ext.len = node->data_size;
+        if(is_padding_box(node->name)) {
+            ext.kind = EXTENT_ZEROS;
+            vfile_add_extent(vf, ext);
+        } else if(node->deferred && node->rearranged) {
+            for(i = 0; i < node->pieces.size(); i++) {
+                ext.kind = node->pieces[i].zeros ? EXTENT_ZEROS : EXTENT_SOURCE;
+                ext.src_offset = node->pieces[i].offset;
+                ext.len = node->pieces[i].size;
+                vfile_add_extent(vf, ext);
+            }
+        } else if(node->deferred) {
+            ext.kind = EXTENT_SOURCE;
+            ext.src_offset = node->offset + node->header_size;
+            vfile_add_extent(vf, ext);
+        } else if(node->data_size > 0 && node->data != NULL) {
+            ext.kind = EXTENT_MEMORY;
+            ext.data = node->data;
+            vfile_add_extent(vf, ext);
+        }
+    }
+    for(i = 0; i < node->children.size(); i++) {
+        if(node->children[i]->active == true) {
+            vfile_add_tree(vf, node->children[i]);
+        }
+    }
+}
+
+//Open a stripped view of the given file. Only the box tree is read;
+//media data stays in the file until it's asked for.
+//Returns NULL if the file can't be opened.
+vfile_t *vfile_open(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    FILE *file = fd < 0 ? NULL : fdopen(dup(fd), "rb");
+    if(file == NULL) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    source_t src = source_from_file(file);
+    if(!src.seekable) {
+        fclose(file);
+        close(fd);
+        return NULL;
+    }
+    vfile_t *vf = new vfile_t();
+    vf->fd = fd;
+    vf->size = 0;
+    vf->tree = build_tree(&src);
+    fclose(file);
+    strip_meta_box(vf->tree);
+    vfile_add_tree(vf, vf->tree);
+    return vf;
+}
+
+//Read up to len bytes of the stripped view at offset, like pread.
+//Returns the number of bytes read, 0 at the end, or -1 on error.
+ssize_t vfile_pread(vfile_t *vf, void *buf, size_t len, uint64_t offset) {
+    unsigned char *p = (unsigned char*)buf;
+    size_t done = 0;
+    if(offset >= vf->size) {
+        return 0;
+    }
+    //The extent holding offset is the last one starting at or before it.
+    size_t lo = 0, hi = vf->extents.size();
+    while(hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(vf->extents[mid].start <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    for(size_t i = lo; i < vf->extents.size() && done < len; i++) {
+        const extent_t &ext = vf->extents[i];
+        uint64_t skip = offset + done - ext.start;
+        size_t n = ext.len - skip < len - done ? ext.len - skip : len - done;
+        switch(ext.kind) {
+        case EXTENT_HEADER:
+            memcpy(p + done, ext.header + skip, n);
+            break;
+        case EXTENT_MEMORY:
+            memcpy(p + done, ext.data + skip, n);
+            break;
+        case EXTENT_ZEROS:
+            memset(p + done, 0, n);
+            break;
+        case EXTENT_SOURCE:
+            for(size_t got = 0; got < n; ) {
+                ssize_t r = pread(vf->fd, p + done + got, n - got, ext.src_offset + skip + got);
+                if(r < 0 && errno == EINTR && !cancelled) {
+                    continue;
+                }
+                if(r <= 0) {
+                    return -1;
+                }
+                got += r;
+            }
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+//Write everything in iov to fd, IOV_MAX buffers at a time.
+//The iovecs are used up in the process.
+int writev_all(int fd, std::vector<struct iovec> &iov) {
+    size_t first = 0;
+    while(first < iov.size()) {
+        ssize_t n = writev(fd, &iov[first], iov.size() - first > IOV_MAX ? IOV_MAX : iov.size() - first);
+        if(n < 0 && errno == EINTR) {
+            check_cancel();
+            continue;
+        }
+        if(n < 0) {
+            return -1;
+        }
+        //Skip what was written, which may end partway into an iovec
+        while(first < iov.size() && (size_t)n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if(first < iov.size()) {
+            iov[first].iov_base = (unsigned char*)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+//Write out a stripped file whose source is held in memory (src_mem)
+//to fd, with as few writev calls as there are IOV_MAX extents. Padding
+//is written as zeros rather than left as holes; in a small file it
+//rarely covers a whole block anyway.
+int vfile_writev(const vfile_t *vf, const unsigned char *src_mem, int fd) {
+    static const unsigned char zeros[65536] = {0};
+    std::vector<struct iovec> iov;
+    size_t i;
+    for(i = 0; i < vf->extents.size(); i++) {
+        const extent_t &ext = vf->extents[i];
+        struct iovec v;
+        v.iov_len = ext.len;
+        switch(ext.kind) {
+        case EXTENT_HEADER:
+            v.iov_base = (void*)ext.header;
+            break;
+        case EXTENT_MEMORY:
+            v.iov_base = (void*)ext.data;
+            break;
+        case EXTENT_SOURCE:
+            v.iov_base = (void*)(src_mem + ext.src_offset);
+            break;
+        case EXTENT_ZEROS:
+            for(uint64_t left = ext.len; left > sizeof(zeros); left -= sizeof(zeros)) {
+                v.iov_base = (void*)zeros;
+                v.iov_len = sizeof(zeros);
+                iov.push_back(v);
+                v.iov_len = left - sizeof(zeros);
+            }
+            v.iov_base = (void*)zeros;
+            break;
+        }
+        iov.push_back(v);
+    }
+    return writev_all(fd, iov);
+}
+
+void vfile_close(vfile_t *vf) {
+    close(vf->fd);
+    free_tree(vf->tree);
+    delete vf;
+}
+
+/* With -S, stripped views are served over HTTP on the loopback interface,
+ * so a player or an upload can fetch the stripped file without a copy of
+ * it ever being written. Each connection is served on a thread of its
+ * own, and gives up after HTTP_TIMEOUT seconds without progress, so a
+ * client that stalls holds up nobody else. One request is answered per
+ * connection. GET and HEAD are supported, with single byte ranges.
+ *
+ * A file's view is parsed once and kept for the requests after it (a
+ * player seeking makes many), up to HTTP_VIEWS_MAX of them; it's parsed
+ * again if the file changes.
+ */
+#define HTTP_TIMEOUT 30
+#define HTTP_VIEWS_MAX 64
+
+typedef struct http_view_t {
+    std::string name;
+    //The file it was parsed from, to tell if it's changed since
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    vfile_t *vf;
+    //Requests using it, and whether it's been dropped from the list
+    int refs;
+    bool dropped;
+    uint64_t last_used;
+} http_view_t;
+
+typedef struct http_server_t {
+    //The served file or directory, with symlinks resolved
+    std::string root;
+    bool root_is_dir;
+    pthread_mutex_t lock;
+    std::vector<http_view_t*> views;
+    uint64_t clock;
+} http_server_t;
+
+typedef struct http_range_t {
+    uint64_t first;
+    uint64_t last;
+} http_range_t;
+
+//Parse a Range header value against a file of the given size.
+//Returns 1 for a satisfiable range, 0 if the header should be ignored
+//and -1 if the range can't be satisfied.
+int http_parse_range(const char *value, uint64_t size, http_range_t *range) {
+    char *end;
+    if(strncmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL) {
+        return 0;
+    }
+    value += 6;
+    if(*value == '-') {
+        uint64_t suffix = strtoull(value + 1, &end, 10);
+        if(end == value + 1 || (*end != '\0' && *end != '\r')) {
+            return 0;
+        }
+        if(suffix == 0 || size == 0) {
+            return -1;
+        }
+        range->first = suffix >= size ? 0 : size - suffix;
+        range->last = size - 1;
+        return 1;
+    }
+    range->first = strtoull(value, &end, 10);
+    if(end == value || *end != '-') {
+        return 0;
+    }
+    value = end + 1;
+    if(*value == '\0' || *value == '\r') {
+        range->last = size - 1;
+    } else {
+        range->last = strtoull(value, &end, 10);
+        if(end == value || (*end != '\0' && *end != '\r') || range->last < range->first) {
+            return 0;
+        }
+        if(range->last >= size) {
+            range->last = size - 1;
+        }
+    }
+    return range->first < size ? 1 : -1;
+}
+
+int http_send(int sock, const void *buf, size_t len) {
+    const char *p = (const char*)buf;
+    while(len > 0) {
+        ssize_t w = send(sock, p, len, MSG_NOSIGNAL);
+        if(w < 0 && errno == EINTR && !cancelled) {
+            continue;
+        }
+        if(w <= 0) {
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+void http_status(int sock, const char *status) {
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+    http_send(sock, head, n);
+}
+
+//Turn the request path into a file name under root, or return false if it
+//names something outside it, by way of .. or of a symlink.
+bool http_path(const std::string &root, bool root_is_dir, const char *path, std::string &name) {
+    std::string rel;
+    for(const char *p = path; *p != '\0' && *p != '?'; p++) {
+        if(p[0] == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+            char hex[3] = { p[1], p[2], '\0' };
+            rel += (char)strtol(hex, NULL, 16);
+            p += 2;
+        } else {
+            rel += *p;
+        }
+    }
+    if(rel.empty() || rel[0] != '/' || rel.find('\0') != std::string::npos ||
+       rel.find("/../") != std::string::npos ||
+       (rel.size() >= 3 && rel.compare(rel.size() - 3, 3, "/..") == 0)) {
+        return false;
+    }
+    if(!root_is_dir) {
+        //A single file is served at any path.
+        name = root;
+        return true;
+    }
+    char *real = realpath((root + rel).c_str(), NULL);
+    if(real == NULL) {
+        //Nothing there; it's a 404 whatever it would have been
+        name = root + rel;
+        return true;
+    }
+    name = real;
+    free(real);
+    return name.compare(0, root.size(), root) == 0 &&
+           (name.size() == root.size() || name[root.size()] == '/' || root == "/");
+}
+
+//Forget a view. It's closed once the last request using it is done.
+//Called with the lock held.
+void http_drop_view(http_server_t *server, size_t i) {
+    http_view_t *view = server->views[i];
+    server->views.erase(server->views.begin() + i);
+    view->dropped = true;
+    if(view->refs == 0) {
+        vfile_close(view->vf);
+        delete view;
+    }
+}
+
+//The view of the named file, parsed now if there isn't an up to date
+//one already. Returns NULL if the file can't be opened.
+http_view_t *http_get_view(http_server_t *server, const std::string &name, const struct stat *st) {
+    size_t i;
+    pthread_mutex_lock(&server->lock);
+    for(i = 0; i < server->views.size(); i++) {
+        http_view_t *view = server->views[i];
+        if(view->name != name) {
+            continue;
+        }
+        if(view->dev == st->st_dev && view->ino == st->st_ino && view->size == st->st_size &&
+           view->mtime.tv_sec == st->st_mtim.tv_sec && view->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            view->refs++;
+            view->last_used = ++server->clock;
+            pthread_mutex_unlock(&server->lock);
+            return view;
+        }
+        http_drop_view(server, i);
+        break;
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    //Parsing doesn't hold up requests for other files
+    vfile_t *vf = vfile_open(name.c_str());
+    if(vf == NULL) {
+        return NULL;
+    }
+    http_view_t *view = new http_view_t();
+    view->name = name;
+    view->dev = st->st_dev;
+    view->ino = st->st_ino;
+    view->size = st->st_size;
+    view->mtime = st->st_mtim;
+    view->vf = vf;
+    view->refs = 1;
+    view->dropped = false;
+    pthread_mutex_lock(&server->lock);
+    view->last_used = ++server->clock;
+    server->views.push_back(view);
+    //Make room by forgetting the least recently used views not in use
+    while(server->views.size() > HTTP_VIEWS_MAX) {
+        size_t oldest = server->views.size();
+        for(i = 0; i < server->views.size(); i++) {
+            if(server->views[i]->refs == 0 &&
+               (oldest == server->views.size() || server->views[i]->last_used < server->views[oldest]->last_used)) {
+                oldest = i;
+            }
+        }
+        if(oldest == server->views.size()) {
+            break;
+        }
+        http_drop_view(server, oldest);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return view;
+}
+
+void http_put_view(http_server_t *server, http_view_t *view) {
+    pthread_mutex_lock(&server->lock);
+    view->refs--;
+    if(view->dropped && view->refs == 0) {
+        vfile_close(view->vf);
+        delete view;
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+void http_serve_one(int sock, http_server_t *server) {
+    char request[8192];
+    size_t used = 0;
+    while(used < sizeof(request) - 1) {
+        ssize_t r = recv(sock, request + used, sizeof(request) - 1 - used, 0);
+        if(r <= 0) {
+            return;
+        }
+        used += r;
+        request[used] = '\0';
+        if(strstr(request, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+    request[used] = '\0';
+
+    char method[16], path[4096];
+    if(sscanf(request, "%15s %4095s", method, path) != 2) {
+        http_status(sock, "400 Bad Request");
+        return;
+    }
+    bool head = strcmp(method, "HEAD") == 0;
+    if(!head && strcmp(method, "GET") != 0) {
+        http_status(sock, "405 Method Not Allowed");
+        return;
+    }
+    std::string name;
+    if(!http_path(server->root, server->root_is_dir, path, name)) {
+        http_status(sock, "403 Forbidden");
+        return;
+    }
+    struct stat st;
+    http_view_t *view = NULL;
+    if(stat(name.c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+       (view = http_get_view(server, name, &st)) == NULL) {
+        http_status(sock, "404 Not Found");
+        return;
+    }
+    vfile_t *vf = view->vf;
+
+    http_range_t range = { 0, vf->size - 1 };
+    int ranged = 0;
+    for(char *line = strstr(request, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if(strncasecmp(line + 2, "Range:", 6) == 0) {
+            const char *value = line + 8;
+            while(*value == ' ') {
+                value++;
+            }
+            ranged = http_parse_range(value, vf->size, &range);
+            break;
+        }
+    }
+
+    char reply[512];
+    int n;
+    if(ranged < 0) {
+        n = snprintf(reply, sizeof(reply),
+                     "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                     "Content-Range: bytes */%llu\r\n"
+                     "Content-Length: 0\r\nConnection: close\r\n\r\n",
+                     (unsigned long long)vf->size);
+        http_send(sock, reply, n);
+        http_put_view(server, view);
+        return;
+    }
+    uint64_t len = vf->size == 0 ? 0 : range.last - range.first + 1;
+    if(ranged > 0) {
+        n = snprintf(reply, sizeof(reply),
+                     "HTTP/1.1 206 Partial Content\r\n"
+                     "Content-Range: bytes %llu-%llu/%llu\r\n",
+                     (unsigned long long)range.first, (unsigned long long)range.last,
+                     (unsigned long long)vf->size);
+    } else {
+        n = snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\n");
+    }
+    n += snprintf(reply + n, sizeof(reply) - n,
+                  "Content-Type: video/mp4\r\nAccept-Ranges: bytes\r\n"
+                  "Content-Length: %llu\r\nConnection: close\r\n\r\n",
+                  (unsigned long long)len);
+    if(http_send(sock, reply, n) != 0 || head) {
+        http_put_view(server, view);
+        return;
+    }
+
+    unsigned char buf[65536];
+    uint64_t offset = range.first;
+    while(len > 0) {
+        size_t want = len > sizeof(buf) ? sizeof(buf) : len;
+        ssize_t got = vfile_pread(vf, buf, want, offset);
+        if(got <= 0 || http_send(sock, buf, got) != 0) {
+            break;
+        }
+        offset += got;
+        len -= got;
+    }
+    http_put_view(server, view);
+}
+
+typedef struct http_connection_t {
+    http_server_t *server;
+    int sock;
+} http_connection_t;
+
+void *http_connection_thread(void *arg) {
+    http_connection_t *conn = (http_connection_t*)arg;
+    http_serve_one(conn->sock, conn->server);
+    close(conn->sock);
+    delete conn;
+    return NULL;
+}
+
+//Serve stripped views of root (a file, or a directory of them) on
+//127.0.0.1:port until killed.
+int serve_http(int port, const char *root) {
+    http_server_t server;
+    struct stat st;
+    char *real = realpath(root, NULL);
+    if(real == NULL || stat(real, &st) != 0) {
+        printf("Could not find %s\n", root);
+        return 1;
+    }
+    server.root = real;
+    free(real);
+    server.root_is_dir = S_ISDIR(st.st_mode);
+    pthread_mutex_init(&server.lock, NULL);
+    server.clock = 0;
+
+    //The connection threads leave the signals to this one, so they
+    //interrupt accept
+    sigset_t signals, old_signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGALRM);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(listener < 0 ||
+       setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+       bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+       listen(listener, 16) != 0) {
+        printf("Could not listen on port %d: %s\n", port, strerror(errno));
+        return 1;
+    }
+    printf("Serving stripped %s on http://127.0.0.1:%d/\n", root, port);
+    fflush(stdout);
+    while(!cancelled) {
+        int sock = accept(listener, NULL, NULL);
+        if(sock < 0) {
+            if(errno == EINTR && cancelled) {
+                close(listener);
+                return 0;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            printf("accept failed: %s\n", strerror(errno));
+            return 1;
+        }
+        struct timeval timeout = { HTTP_TIMEOUT, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        http_connection_t *conn = new http_connection_t();
+        conn->server = &server;
+        conn->sock = sock;
+        pthread_t thread;
+        pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+        int started = pthread_create(&thread, &attr, http_connection_thread, conn);
+        pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+        if(started != 0) {
+            //No thread to be had; serve it on this one
+            http_connection_thread(conn);
+        }
+    }
+    close(listener);
+    return 0;
+}
+
+/* With -B, each phase of a run reports its wall time, its throughput
+ * over the input and the peak resident set size so far on stderr, for
+ * perf-check.sh to compare with the stored baseline.
+ */
+typedef struct bench_t {
+    bool enabled;
+    struct timespec start;
+} bench_t;
+
+bench_t bench;
+
+void bench_start() {
+    clock_gettime(CLOCK_MONOTONIC, &bench.start);
+}
+
+void bench_end(const char *phase, uint64_t bytes) {
+    struct timespec end;
+    struct rusage usage;
+    if(!bench.enabled) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &usage);
+    double seconds = (end.tv_sec - bench.start.tv_sec) + (end.tv_nsec - bench.start.tv_nsec) / 1e9;
+    fprintf(stderr, "bench %s %.6f %.1f %ld\n", phase, seconds,
+            seconds > 0 ? bytes / seconds / 1e6 : 0.0, usage.ru_maxrss);
+}
+
+void usage() {
+    printf("Usage: m4mudex [-c copy]... [-s sidecar] <infilename> <outfilename>\n");
+    printf("       m4mudex -i <filename>\n");
+    printf("       m4mudex -t <intar|-> <outtar|->\n");
+    printf("       m4mudex -V <original> <stripped>\n");
+    printf("       m4mudex -B <infilename> <outfilename>\n");
+    printf("       m4mudex -S <port> <file|directory>\n");
+    printf("       m4mudex probe <filename>...\n");
+    printf("       m4mudex analyze [-w seconds] <filename>...\n");
+    printf("       m4mudex diff <a> <b>\n");
+    printf("       m4mudex export-es [-t track] <infilename> <outfilename|->\n");
+    printf("       m4mudex mux-adts <infilename|-> <outfilename|->\n");
+    printf("       m4mudex batch [-j jobs] [--hdd-jobs jobs] [--ssd-jobs jobs] <outdir> <infilename>... [-- options]\n");
+    printf("       m4mudex [-d track]... [-a align] [-A] [--sidx] [--mfra] [--cache dir] [-m merkle] <infilename> <outfilename>\n");
+    printf("\n");
+    printf("  -i  strip in place: meta boxes become free space, and\n");
+    printf("      their disk blocks are released\n");
+    printf("  -t  read a tar archive and write a copy with every MPEG-4\n");
+    printf("      member stripped\n");
+    printf("  -c  also write an untouched copy of the input to this file\n");
+    printf("  -s  also write the input's size and SHA-256 to this file\n");
+    printf("  -V  check that a stripped file is well formed and carries\n");
+    printf("      the same media data as the original\n");
+    printf("  -B  report the time, throughput (MB/s of input) and peak RSS\n");
+    printf("      of each phase on stderr\n");
+    printf("  -d, --drop-track  also remove a track, given by track ID or\n");
+    printf("      handler type (soun, vide, text, ...), and its media data\n");
+    printf("  -a, --align  start each mdat payload at a multiple of this many\n");
+    printf("      bytes, padding with free boxes\n");
+    printf("  -A, --align-chunks  also start every chunk at a multiple of the\n");
+    printf("      alignment (4096 if -a isn't given), padding with zeros\n");
+    printf("  --sidx  index a fragmented file's fragments in a sidx box\n");
+    printf("      ahead of the first one\n");
+    printf("  --mfra  list a fragmented file's sync samples in an mfra box\n");
+    printf("      at the end\n");
+    printf("  --cache  keep results in this directory, and hand out the one\n");
+    printf("      for an input seen before instead of stripping it again\n");
+    printf("  -m  also write a Merkle tree of the hashes of the output's\n");
+    printf("      chunks to this file\n");
+    printf("  --deadline  give up after this many seconds\n");
+    printf("  --small-file-max  read inputs up to this many bytes into\n");
+    printf("      memory whole (16 MB by default, 0 for never)\n");
+    printf("  -S  serve stripped views of a file, or of the files in a\n");
+    printf("      directory, over HTTP on 127.0.0.1, without writing them\n");
+    printf("\n");
+    printf("probe prints a JSON record for each file, describing its tracks\n");
+    printf("from the moov box alone. analyze prints each track's bitrate\n");
+    printf("for every second, its peak bitrate over a sliding window (1s by\n");
+    printf("default) and the spacing of its sync samples, from the sample\n");
+    printf("tables alone. diff lists the boxes added, removed or changed\n");
+    printf("between two files, and whether their tracks carry the same media.\n");
+    printf("export-es writes a track (the first AAC, H.264 or HEVC one, unless\n");
+    printf("-t picks one by ID or handler) as an ADTS or Annex B stream.\n");
+    printf("mux-adts wraps an ADTS stream in an .m4a file with no metadata.\n");
+    printf("batch strips each file into outdir, with the options after --,\n");
+    printf("running one job at a time on each spinning disk and four on\n");
+    printf("each other one, unless told otherwise (-j sets both).\n");
+    printf("\n");
+    printf("The copies and the sidecar are written from the same single\n");
+    printf("pass over the input as the stripped output.\n");
+    printf("\n");
+    printf("A file name of - means stdin or stdout.\n");
+    printf("\n");
+    printf("A run that's cancelled with a signal or passes its deadline\n");
+    printf("removes its partial output and exits with status %d.\n", EXIT_CANCELLED);
+}
+
+//Open a file named on the command line, where - means stdin or stdout.
+FILE *open_arg(const char *name, const char *mode) {
+    if(strcmp(name, "-") == 0) {
+        return mode[0] == 'r' ? stdin : stdout;
+    }
+    return fopen(name, mode);
+}
+
+/* probe reports what's in a file from its moov box alone: for each
+ * track the handler, the codec and its sample entry parameters, the
+ * timescale, duration, sample count and average bitrate. The media
+ * data is never read. Each file gets one JSON record, on one line.
+ */
+
+//The length of the well-formed UTF-8 sequence at s (RFC 3629: no
+//overlong forms, surrogates or code points past U+10FFFF), or 0 if
+//there isn't one.
+size_t utf8_sequence_len(const unsigned char *s, size_t avail) {
+    size_t len, i;
+    uint32_t cp;
+    if(s[0] < 0x80) {
+        return 1;
+    } else if(s[0] >= 0xc2 && s[0] <= 0xdf) {
+        len = 2;
+        cp = s[0] & 0x1f;
+    } else if(s[0] >= 0xe0 && s[0] <= 0xef) {
+        len = 3;
+        cp = s[0] & 0x0f;
+    } else if(s[0] >= 0xf0 && s[0] <= 0xf4) {
+        len = 4;
+        cp = s[0] & 0x07;
+    } else {
+        return 0;
+    }
+    if(len > avail) {
+        return 0;
+    }
+    for(i = 1; i < len; i++) {
+        if((s[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        cp = cp << 6 | (s[i] & 0x3f);
+    }
+    if((len == 3 && cp < 0x800) || (len == 4 && (cp < 0x10000 || cp > 0x10ffff)) ||
+       (cp >= 0xd800 && cp <= 0xdfff)) {
+        return 0;
+    }
+    return len;
+}
+
+//Write s as a JSON string. UTF-8 is passed through as it is; anything
+//that isn't well-formed UTF-8 comes out as U+FFFD, one for each byte.
+void json_string(FILE *out, const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char*)s;
+    size_t i = 0;
+    fputc('"', out);
+    while(i < len) {
+        unsigned char c = p[i];
+        size_t n = utf8_sequence_len(p + i, len - i);
+        if(n == 0) {
+            fputs("\\ufffd", out);
+            i++;
+        } else if(c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+            i++;
+        } else if(c < 0x20 || c == 0x7f) {
+            fprintf(out, "\\u%04x", c);
+            i++;
+        } else {
+            fwrite(p + i, 1, n, out);
+            i += n;
+        }
+    }
+    fputc('"', out);
+}
+
+//Read the length of an MPEG-4 descriptor (ISO 14496-1), which is
+//stored 7 bits at a time. Returns the number of bytes used, or 0.
+size_t get_descriptor_len(const unsigned char *p, size_t avail, uint32_t *len) {
+    size_t i;
+    *len = 0;
+    for(i = 0; i < 4 && i < avail; i++) {
+        *len = *len << 7 | (p[i] & 0x7f);
+        if(!(p[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+//Find the descriptor with the given tag at the start of p, and return
+//its contents, or NULL.
+const unsigned char *get_descriptor(const unsigned char *p, size_t avail, int tag, uint32_t *len) {
+    if(avail < 2 || p[0] != tag) {
+        return NULL;
+    }
+    size_t n = get_descriptor_len(p + 1, avail - 1, len);
+    if(n == 0 || 1 + n + *len > avail) {
+        return NULL;
+    }
+    return p + 1 + n;
+}
+
+//Find the decoder configuration in an esds: the object type indication
+//(0x40 for MPEG-4 audio), and the decoder specific info, which is NULL if
+//there isn't any.
+bool get_esds_config(const unsigned char *esds, size_t size, int *object_type,
+                     const unsigned char **dsi, uint32_t *dsi_len) {
+    uint32_t len, dlen;
+    if(size < 4) {
+        return false;
+    }
+    const unsigned char *es = get_descriptor(esds + 4, size - 4, 3, &len);
+    if(es == NULL || len < 3) {
+        return false;
+    }
+    size_t skip = 3;
+    if(es[2] & 0x80) {
+        skip += 2;
+    }
+    if((es[2] & 0x40) && len > skip) {
+        skip += 1 + es[skip];
+    }
+    if(es[2] & 0x20) {
+        skip += 2;
+    }
+    if(skip >= len) {
+        return false;
+    }
+    const unsigned char *dc = get_descriptor(es + skip, len - skip, 4, &dlen);
+    if(dc == NULL || dlen < 13) {
+        return false;
+    }
+    *object_type = dc[0];
+    *dsi = get_descriptor(dc + 13, dlen - 13, 5, dsi_len);
+    return true;
+}
+
+//Work out the RFC 6381 codec string of an mp4a sample entry from its
+//esds, e.g. "mp4a.40.2" for AAC LC.
+bool get_mp4a_codec(const unsigned char *esds, size_t size, char *codec, size_t codec_len) {
+    const unsigned char *dsi;
+    uint32_t slen;
+    int object_type;
+    if(!get_esds_config(esds, size, &object_type, &dsi, &slen)) {
+        return false;
+    }
+    if(object_type != 0x40 || dsi == NULL || slen < 1) {
+        snprintf(codec, codec_len, "mp4a.%02x", object_type);
+        return true;
+    }
+    int aot = dsi[0] >> 3;
+    if(aot == 31 && slen >= 2) {
+        aot = 32 + ((dsi[0] & 7) << 3 | dsi[1] >> 5);
+    }
+    snprintf(codec, codec_len, "mp4a.40.%d", aot);
+    return true;
+}
+
+//Find a child box of a sample entry, starting at skip bytes in.
+const unsigned char *find_entry_box(const unsigned char *entry, uint32_t size, uint32_t skip,
+                                    const char *name, uint32_t *box_size) {
+    while(skip + 8 <= size) {
+        uint32_t len = get_be32(entry + skip);
+        if(len < 8 || skip + len > size) {
+            return NULL;
+        }
+        if(memcmp(entry + skip + 4, name, 4) == 0) {
+            *box_size = len - 8;
+            return entry + skip + 8;
+        }
+        skip += len;
+    }
+    return NULL;
+}
+
+//Report the first sample entry of an stsd box, which is where the codec
+//and its parameters are.
+void probe_sample_entry(atom_t *stsd, const char *handler, FILE *out) {
+    if(stsd == NULL || stsd->data_size < 16 || get_be32(stsd->data + 4) < 1) {
+        return;
+    }
+    const unsigned char *entry = stsd->data + 8;
+    uint32_t size = get_be32(entry);
+    uint32_t box_size;
+    char codec[32];
+    if(size < 16 || size > stsd->data_size - 8) {
+        return;
+    }
+    fprintf(out, ",\"codec\":");
+    json_string(out, (const char*)entry + 4, 4);
+
+    if(fourcc(handler) == fourcc("soun") && size >= 36) {
+        //SampleEntry header, then version, revision and vendor
+        fprintf(out, ",\"channels\":%u,\"sample_size\":%u,\"sample_rate\":%u",
+                entry[24] << 8 | entry[25], entry[26] << 8 | entry[27], get_be32(entry + 32) >> 16);
+        //QuickTime sound description versions 1 and 2 are longer
+        int version = entry[16] << 8 | entry[17];
+        uint32_t skip = 36 + (version == 1 ? 16 : version == 2 ? 36 : 0);
+        const unsigned char *esds = find_entry_box(entry, size, skip, "esds", &box_size);
+        if(memcmp(entry + 4, "mp4a", 4) == 0 && esds != NULL &&
+           get_mp4a_codec(esds, box_size, codec, sizeof(codec))) {
+            fprintf(out, ",\"codec_string\":\"%s\"", codec);
+        }
+    } else if(fourcc(handler) == fourcc("vide") && size >= 86) {
+        fprintf(out, ",\"width\":%u,\"height\":%u",
+                entry[32] << 8 | entry[33], entry[34] << 8 | entry[35]);
+        const unsigned char *avcc = find_entry_box(entry, size, 86, "avcC", &box_size);
+        const unsigned char *hvcc = find_entry_box(entry, size, 86, "hvcC", &box_size);
+        if(avcc != NULL && box_size >= 4) {
+            snprintf(codec, sizeof(codec), "%.4s.%02x%02x%02x", entry + 4, avcc[1], avcc[2], avcc[3]);
+            fprintf(out, ",\"codec_string\":\"%s\"", codec);
+        } else if(hvcc != NULL && box_size >= 13) {
+            fprintf(out, ",\"profile\":%u,\"level\":%u", hvcc[1] & 0x1f, hvcc[12]);
+        }
+    }
+}
+
+//Report one track, from its tkhd, mdhd, hdlr and sample tables.
+void probe_track(atom_t *trak, FILE *out) {
+    atom_t *mdhd = find_box(trak, "mdia/mdhd");
+    atom_t *hdlr = find_box(trak, "mdia/hdlr");
+    atom_t *stsz = find_box(trak, "mdia/minf/stbl/stsz");
+    char handler[5] = "";
+    uint32_t timescale = 0;
+    uint64_t duration = 0;
+    uint32_t i;
+
+    fprintf(out, "{\"id\":%u", get_track_id(trak));
+    if(hdlr != NULL && hdlr->data_size >= 12) {
+        memcpy(handler, hdlr->data + 8, 4);
+        fprintf(out, ",\"handler\":");
+        json_string(out, handler, 4);
+    }
+    if(mdhd != NULL && mdhd->data_size >= 24) {
+        const unsigned char *p = mdhd->data;
+        bool v1 = p[0] == 1 && mdhd->data_size >= 36;
+        timescale = get_be32(p + (v1 ? 20 : 12));
+        duration = v1 ? get_be64(p + 24) : get_be32(p + 16);
+        uint16_t lang = p[v1 ? 32 : 20] << 8 | p[v1 ? 33 : 21];
+        char language[3] = { (char)(0x60 + (lang >> 10 & 0x1f)), (char)(0x60 + (lang >> 5 & 0x1f)),
+                             (char)(0x60 + (lang & 0x1f)) };
+        fprintf(out, ",\"timescale\":%u,\"duration\":%.3f,\"language\":", timescale,
+                timescale > 0 ? (double)duration / timescale : 0.0);
+        json_string(out, language, 3);
+    }
+    probe_sample_entry(find_box(trak, "mdia/minf/stbl/stsd"), handler, out);
+
+    if(stsz != NULL && stsz->data_size >= 12) {
+        uint32_t sample_size = get_be32(stsz->data + 4);
+        uint32_t count = get_be32(stsz->data + 8);
+        uint64_t bytes = (uint64_t)sample_size * count;
+        if(sample_size == 0 && 12 + 4 * (uint64_t)count <= stsz->data_size) {
+            for(i = 0; i < count; i++) {
+                bytes += get_be32(stsz->data + 12 + 4 * i);
+            }
+        }
+        fprintf(out, ",\"samples\":%u,\"bytes\":%llu", count, (unsigned long long)bytes);
+        if(timescale > 0 && duration > 0) {
+            fprintf(out, ",\"bitrate\":%.0f", bytes * 8.0 * timescale / duration);
+        }
+    }
+    fprintf(out, "}");
+}
+
+//Print the JSON record for one file. Returns 0, or -1 if it can't
+//be read.
+int probe_file(const char *filename, FILE *out) {
+    FILE *file = fopen(filename, "rb");
+    uint32_t i;
+    fprintf(out, "{\"file\":");
+    json_string(out, filename, strlen(filename));
+    if(file == NULL) {
+        fprintf(out, ",\"error\":");
+        json_string(out, strerror(errno), strlen(strerror(errno)));
+        fprintf(out, "}\n");
+        return -1;
+    }
+    source_t src = source_from_file(file);
+    atom_t *root = build_tree(&src);
+    atom_t *ftyp = find_box(root, "ftyp");
+    atom_t *mvhd = find_box(root, "moov/mvhd");
+    atom_t *moov = find_box(root, "moov");
+    fclose(file);
+
+    fprintf(out, ",\"size\":%llu", (unsigned long long)src.limit);
+    if(ftyp != NULL && ftyp->data_size >= 4) {
+        fprintf(out, ",\"brand\":");
+        json_string(out, (const char*)ftyp->data, 4);
+    }
+    if(mvhd != NULL && mvhd->data_size >= 20) {
+        const unsigned char *p = mvhd->data;
+        bool v1 = p[0] == 1 && mvhd->data_size >= 32;
+        uint32_t timescale = get_be32(p + (v1 ? 20 : 12));
+        uint64_t duration = v1 ? get_be64(p + 24) : get_be32(p + 16);
+        fprintf(out, ",\"duration\":%.3f", timescale > 0 ? (double)duration / timescale : 0.0);
+    }
+    if(find_box(root, "moof") != NULL) {
+        fprintf(out, ",\"fragmented\":true");
+    }
+    if(moov == NULL) {
+        fprintf(out, ",\"error\":\"no moov box\"}\n");
+        free_tree(root);
+        return -1;
+    }
+    fprintf(out, ",\"tracks\":[");
+    bool first = true;
+    for(i = 0; i < moov->children.size(); i++) {
+        if(is_box(moov->children[i], "trak")) {
+            if(!first) {
+                fputc(',', out);
+            }
+            probe_track(moov->children[i], out);
+            first = false;
+        }
+    }
+    fprintf(out, "]}\n");
+    free_tree(root);
+    return 0;
+}
+
+//m4mudex probe <file>...
+int main_probe(int argc, char **argv) {
+    int status = 0;
+    int i;
+    if(argc < 1) {
+        usage();
+        exit(1);
+    }
+    for(i = 0; i < argc; i++) {
+        if(probe_file(argv[i], stdout) != 0) {
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* analyze works out how each track's bitrate varies over time, and how
+ * far apart its sync samples are, from the sample tables alone: stsz for
+ * the sizes, stts for the timing and stss for the sync samples. The
+ * sizes and times are loaded into a sample index, and everything else is
+ * a single pass over that.
+ */
+
+/* A sample index holds a track's sample sizes and decode times in a
+ * fraction of the memory flat arrays would take; a day-long recording
+ * has tens of millions of samples.
+ *
+ * Sizes are bit-packed in blocks of SAMPLE_BLOCK samples. Each block
+ * keeps its smallest size, and each sample its difference from that, in
+ * as many bits as the block's largest difference needs. The sizes of a
+ * stream's samples stay within a narrow range, so that's typically 8 to
+ * 12 bits a sample rather than 32, and any one size is a shift and a
+ * mask away. Decode times are kept the way stts has them, as runs of
+ * samples with the same duration, with each run's first sample and start
+ * time added, so the time of any sample is a binary search away.
+ */
+#define SAMPLE_BLOCK 128
+
+typedef struct time_run_t {
+    uint32_t first_sample;
+    uint32_t delta;
+    uint64_t start;
+} time_run_t;
+
+typedef struct sample_index_t {
+    uint32_t count;
+    std::vector<uint32_t> block_min;
+    std::vector<uint8_t> block_bits;
+    std::vector<uint64_t> block_pos;    //where each block starts in packed, in bits
+    std::vector<uint64_t> packed;
+    std::vector<time_run_t> runs;
+    uint64_t end;                       //decode time at the end of the last sample
+} sample_index_t;
+
+void put_packed(std::vector<uint64_t> &packed, uint64_t pos, int bits, uint64_t v) {
+    packed[pos / 64] |= v << (pos % 64);
+    if(pos % 64 + bits > 64) {
+        packed[pos / 64 + 1] |= v >> (64 - pos % 64);
+    }
+}
+
+uint32_t sample_size(const sample_index_t *index, uint32_t i) {
+    uint32_t block = i / SAMPLE_BLOCK;
+    int bits = index->block_bits[block];
+    if(bits == 0) {
+        return index->block_min[block];
+    }
+    uint64_t pos = index->block_pos[block] + (uint64_t)(i % SAMPLE_BLOCK) * bits;
+    uint64_t v = index->packed[pos / 64] >> (pos % 64);
+    if(pos % 64 + bits > 64) {
+        v |= index->packed[pos / 64 + 1] << (64 - pos % 64);
+    }
+    return index->block_min[block] + (uint32_t)(v & ((1ULL << bits) - 1));
+}
+
+//The decode time of sample i; for i == count, the end of the last one.
+uint64_t sample_time(const sample_index_t *index, uint32_t i) {
+    if(i >= index->count) {
+        return index->end;
+    }
+    //The run holding i is the last one starting at or before it
+    size_t lo = 0, hi = index->runs.size();
+    while(hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(index->runs[mid].first_sample <= i) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    const time_run_t &run = index->runs[lo];
+    return run.start + (uint64_t)(i - run.first_sample) * run.delta;
+}
+
+//Load stsz into the index.
+//Returns 0, or -1 if the table is missing or inconsistent.
+int index_sample_sizes(atom_t *trak, sample_index_t *index) {
+    atom_t *stsz = find_box(trak, "mdia/minf/stbl/stsz");
+    uint32_t i, block;
+    if(stsz == NULL || stsz->data_size < 12) {
+        return -1;
+    }
+    uint32_t fixed_size = get_be32(stsz->data + 4);
+    uint32_t count = get_be32(stsz->data + 8);
+    if(fixed_size == 0 && 12 + 4 * (uint64_t)count > stsz->data_size) {
+        return -1;
+    }
+    const unsigned char *sizes = stsz->data + 12;
+    uint32_t blocks = (count + SAMPLE_BLOCK - 1) / SAMPLE_BLOCK;
+    uint64_t pos = 0;
+    index->count = count;
+    index->block_min.resize(blocks);
+    index->block_bits.resize(blocks);
+    index->block_pos.resize(blocks);
+    for(block = 0; block < blocks; block++) {
+        uint32_t first = block * SAMPLE_BLOCK;
+        uint32_t last = count - first < SAMPLE_BLOCK ? count : first + SAMPLE_BLOCK;
+        uint32_t min = UINT32_MAX, max = 0;
+        int bits = 0;
+        for(i = first; i < last; i++) {
+            uint32_t size = fixed_size != 0 ? fixed_size : get_be32(sizes + 4 * i);
+            min = size < min ? size : min;
+            max = size > max ? size : max;
+        }
+        while(bits < 32 && (uint64_t)(max - min) >> bits != 0) {
+            bits++;
+        }
+        index->block_min[block] = min;
+        index->block_bits[block] = bits;
+        index->block_pos[block] = pos;
+        pos += (uint64_t)bits * (last - first);
+    }
+    //One spare word, so a value can always be read as two
+    index->packed.assign(pos / 64 + 2, 0);
+    for(i = 0; fixed_size == 0 && i < count; i++) {
+        block = i / SAMPLE_BLOCK;
+        int bits = index->block_bits[block];
+        if(bits > 0) {
+            put_packed(index->packed, index->block_pos[block] + (uint64_t)(i % SAMPLE_BLOCK) * bits,
+                       bits, get_be32(sizes + 4 * i) - index->block_min[block]);
+        }
+    }
+    return 0;
+}
+
+//Load stts into the index, which must already have the sizes.
+//Returns 0, or -1 if the table is missing or doesn't cover every sample.
+int index_sample_times(atom_t *trak, sample_index_t *index) {
+    atom_t *stts = find_box(trak, "mdia/minf/stbl/stts");
+    uint32_t i;
+    if(stts == NULL || stts->data_size < 8) {
+        return -1;
+    }
+    uint32_t entries = get_be32(stts->data + 4);
+    if(8 + 8 * (uint64_t)entries > stts->data_size) {
+        return -1;
+    }
+    uint64_t sample = 0, t = 0;
+    index->runs.clear();
+    for(i = 0; i < entries; i++) {
+        time_run_t run = { (uint32_t)sample, get_be32(stts->data + 12 + 8 * i), t };
+        uint32_t count = get_be32(stts->data + 8 + 8 * i);
+        if(count == 0) {
+            continue;
+        }
+        index->runs.push_back(run);
+        sample += count;
+        t += (uint64_t)count * run.delta;
+        if(sample > index->count) {
+            return -1;
+        }
+    }
+    index->end = t;
+    return sample == index->count ? 0 : -1;
+}
+
+//Analyze one track, printing its JSON record.
+void analyze_track(atom_t *trak, double window, FILE *out) {
+    atom_t *mdhd = find_box(trak, "mdia/mdhd");
+    atom_t *hdlr = find_box(trak, "mdia/hdlr");
+    atom_t *stss = find_box(trak, "mdia/minf/stbl/stss");
+    sample_index_t index;
+    uint64_t i, j;
+
+    fprintf(out, "{\"id\":%u", get_track_id(trak));
+    if(hdlr != NULL && hdlr->data_size >= 12) {
+        fprintf(out, ",\"handler\":");
+        json_string(out, (const char*)hdlr->data + 8, 4);
+    }
+    uint32_t timescale = 0;
+    if(mdhd != NULL && mdhd->data_size >= 24) {
+        timescale = get_be32(mdhd->data + (mdhd->data[0] == 1 && mdhd->data_size >= 36 ? 20 : 12));
+    }
+    if(timescale == 0 || index_sample_sizes(trak, &index) != 0 || index_sample_times(trak, &index) != 0) {
+        fprintf(out, ",\"error\":\"unreadable sample tables\"}");
+        return;
+    }
+    uint64_t n = index.count;
+
+    //Bits in each whole second of the track, by decode time
+    uint64_t seconds = (index.end + timescale - 1) / timescale;
+    if(seconds > 10 * (n + 1) + 86400) {
+        fprintf(out, ",\"error\":\"implausible track duration\"}");
+        return;
+    }
+    std::vector<uint64_t> curve(seconds, 0);
+    for(i = 0; i < n; i++) {
+        curve[sample_time(&index, i) / timescale] += sample_size(&index, i);
+    }
+    fprintf(out, ",\"bitrate_curve\":[");
+    for(i = 0; i < seconds; i++) {
+        fprintf(out, i > 0 ? ",%llu" : "%llu", (unsigned long long)curve[i] * 8);
+    }
+    fprintf(out, "]");
+
+    //The busiest stretch of the track no longer than the window. Two
+    //indexes walk the samples, so each sample is added and removed once.
+    uint64_t span = (uint64_t)(window * timescale);
+    uint64_t bytes = 0, peak = 0, peak_at = 0;
+    for(i = 0, j = 0; j < n; j++) {
+        bytes += sample_size(&index, j);
+        while(sample_time(&index, j + 1) - sample_time(&index, i) > span && i < j) {
+            bytes -= sample_size(&index, i++);
+        }
+        if(bytes > peak) {
+            peak = bytes;
+            peak_at = sample_time(&index, i);
+        }
+    }
+    fprintf(out, ",\"peak_bitrate\":{\"window\":%.3f,\"bitrate\":%.0f,\"at\":%.3f}",
+            window, span > 0 ? peak * 8.0 * timescale / span : 0.0, (double)peak_at / timescale);
+
+    //Distances between sync samples, in samples and in seconds. Without
+    //an stss every sample is a sync sample.
+    if(stss == NULL || stss->data_size < 8) {
+        fprintf(out, ",\"gop\":{\"all_sync\":true}}");
+        return;
+    }
+    uint32_t syncs = get_be32(stss->data + 4);
+    if(8 + 4 * (uint64_t)syncs > stss->data_size) {
+        fprintf(out, ",\"gop\":null}");
+        return;
+    }
+    uint64_t gops = 0, shortest = UINT64_MAX, longest = 0, total = 0, samples = 0;
+    uint64_t prev = 0;
+    for(i = 0; i <= syncs; i++) {
+        //The last GOP runs to the end of the track
+        uint64_t sample = i < syncs ? get_be32(stss->data + 8 + 4 * i) - 1 : n;
+        if(sample > n || (i > 0 && sample <= prev)) {
+            continue;
+        }
+        if(i > 0) {
+            uint64_t len = sample - prev;
+            gops++;
+            samples += len;
+            total += sample_time(&index, sample) - sample_time(&index, prev);
+            shortest = len < shortest ? len : shortest;
+            longest = len > longest ? len : longest;
+        }
+        prev = sample;
+    }
+    fprintf(out, ",\"gop\":{\"count\":%llu", (unsigned long long)gops);
+    if(gops > 0) {
+        fprintf(out, ",\"min\":%llu,\"max\":%llu,\"mean\":%.2f,\"mean_seconds\":%.3f",
+                (unsigned long long)shortest, (unsigned long long)longest,
+                (double)samples / gops,
+                (double)total / gops / timescale);
+    }
+    fprintf(out, "}}");
+}
+
+//Print the JSON record for one file. Returns 0, or -1 if it can't
+//be read.
+int analyze_file(const char *filename, double window, FILE *out) {
+    FILE *file = fopen(filename, "rb");
+    uint32_t i;
+    fprintf(out, "{\"file\":");
+    json_string(out, filename, strlen(filename));
+    if(file == NULL) {
+        fprintf(out, ",\"error\":");
+        json_string(out, strerror(errno), strlen(strerror(errno)));
+        fprintf(out, "}\n");
+        return -1;
+    }
+    source_t src = source_from_file(file);
+    atom_t *root = build_tree(&src);
+    atom_t *moov = find_box(root, "moov");
+    fclose(file);
+    if(moov == NULL) {
+        fprintf(out, ",\"error\":\"no moov box\"}\n");
+        free_tree(root);
+        return -1;
+    }
+    fprintf(out, ",\"tracks\":[");
+    bool first = true;
+    for(i = 0; i < moov->children.size(); i++) {
+        if(is_box(moov->children[i], "trak")) {
+            if(!first) {
+                fputc(',', out);
+            }
+            analyze_track(moov->children[i], window, out);
+            first = false;
+        }
+    }
+    fprintf(out, "]}\n");
+    free_tree(root);
+    return 0;
+}
+
+//m4mudex analyze [-w seconds] <file>...
+int main_analyze(int argc, char **argv) {
+    double window = 1.0;
+    int status = 0;
+    int i = 0;
+    if(argc >= 2 && strcmp(argv[0], "-w") == 0) {
+        window = atof(argv[1]);
+        if(window <= 0) {
+            printf("Bad window %s\n", argv[1]);
+            exit(1);
+        }
+        i = 2;
+    }
+    if(i >= argc) {
+        usage();
+        exit(1);
+    }
+    for(; i < argc; i++) {
+        if(analyze_file(argv[i], window, stdout) != 0) {
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* export-es writes the samples of one track as a raw elementary stream,
+ * for tools that take one rather than an MPEG-4 file. AAC comes out as
+ * ADTS: each frame gets the 7-byte header a decoder needs, made up from
+ * the AudioSpecificConfig in the esds. H.264 and HEVC come out as an
+ * Annex B byte stream: the length ahead of each NAL unit becomes a start
+ * code, and the parameter sets from the avcC or hvcC are repeated ahead
+ * of every sync sample, so a decoder can start at any of them.
+ *
+ * The samples are found from the sample tables, the media data is read
+ * a chunk at a time, and each chunk is written with one writev straight
+ * from the buffer it was read into, with the headers and start codes
+ * gathered in between.
+ */
+enum es_kind_t {
+    ES_ADTS,
+    ES_ANNEX_B
+};
+
+typedef struct es_format_t {
+    es_kind_t kind;
+    //ES_ADTS: the header, but for the frame length
+    unsigned char adts[7];
+    //ES_ANNEX_B: the size of the NAL unit lengths, and the parameter
+    //sets with their start codes, ready to go ahead of a sync sample
+    int length_size;
+    std::string parameter_sets;
+} es_format_t;
+
+const unsigned char start_code[4] = { 0, 0, 0, 1 };
+
+const uint32_t aac_sample_rates[13] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+//Read n bits (at most 24) from p, starting at bit *pos.
+//Returns -1 past the end of the buffer.
+int get_bits(const unsigned char *p, uint32_t len, uint32_t *pos, int n) {
+    int v = 0;
+    for(int i = 0; i < n; i++, (*pos)++) {
+        if(*pos / 8 >= len) {
+            return -1;
+        }
+        v = v << 1 | (p[*pos / 8] >> (7 - *pos % 8) & 1);
+    }
+    return v;
+}
+
+//Make the ADTS header for an AudioSpecificConfig. ADTS can only describe
+//the four original AAC object types, so HE-AAC goes out as its AAC LC
+//core, which is how encoders write it to ADTS too.
+bool get_adts_header(const unsigned char *dsi, uint32_t len, unsigned char *header) {
+    uint32_t pos = 0;
+    int aot = get_bits(dsi, len, &pos, 5);
+    if(aot == 31) {
+        aot = 32 + get_bits(dsi, len, &pos, 6);
+    }
+    int rate_index = get_bits(dsi, len, &pos, 4);
+    int rate = rate_index == 15 ? get_bits(dsi, len, &pos, 24) : 0;
+    int channels = get_bits(dsi, len, &pos, 4);
+    if(aot == 5 || aot == 29) {
+        //SBR (and PS): the extension's sample rate, then the core's object type
+        if(get_bits(dsi, len, &pos, 4) == 15) {
+            get_bits(dsi, len, &pos, 24);
+        }
+        aot = get_bits(dsi, len, &pos, 5);
+    }
+    if(rate_index == 15) {
+        for(rate_index = 0; rate_index < 13 && aac_sample_rates[rate_index] != (uint32_t)rate; rate_index++) {
+        }
+    }
+    if(aot < 1 || aot > 4 || rate_index < 0 || rate_index > 12 || channels < 0 || channels > 7) {
+        return false;
+    }
+    header[0] = 0xff;
+    header[1] = 0xf1;   //MPEG-4, no CRC
+    header[2] = (aot - 1) << 6 | rate_index << 2 | channels >> 2;
+    header[3] = (channels & 3) << 6;
+    header[4] = 0;
+    header[5] = 0x1f;   //buffer fullness 0x7ff, for variable bitrate
+    header[6] = 0xfc;
+    return true;
+}
+
+//Append count parameter sets, each a 16-bit length and a NAL unit, from
+//p at *pos to the format's parameter sets, with start codes.
+bool get_parameter_sets(const unsigned char *p, uint32_t len, uint32_t *pos, uint32_t count,
+                        es_format_t *fmt) {
+    uint32_t i;
+    for(i = 0; i < count; i++) {
+        if(*pos + 2 > len) {
+            return false;
+        }
+        uint32_t n = p[*pos] << 8 | p[*pos + 1];
+        *pos += 2;
+        if(*pos + n > len) {
+            return false;
+        }
+        fmt->parameter_sets.append((const char*)start_code, 4);
+        fmt->parameter_sets.append((const char*)p + *pos, n);
+        *pos += n;
+    }
+    return true;
+}
+
+//The NAL unit length size and the SPS and PPS of an avcC.
+bool get_avcc_format(const unsigned char *p, uint32_t len, es_format_t *fmt) {
+    uint32_t pos = 6;
+    if(len < 7) {
+        return false;
+    }
+    fmt->length_size = (p[4] & 3) + 1;
+    if(!get_parameter_sets(p, len, &pos, p[5] & 0x1f, fmt) || pos >= len) {
+        return false;
+    }
+    pos++;
+    return get_parameter_sets(p, len, &pos, p[pos - 1], fmt);
+}
+
+//The NAL unit length size and the VPS, SPS, PPS and SEI of an hvcC,
+//which come in arrays by NAL unit type.
+bool get_hvcc_format(const unsigned char *p, uint32_t len, es_format_t *fmt) {
+    uint32_t pos = 23, i;
+    if(len < 23) {
+        return false;
+    }
+    fmt->length_size = (p[21] & 3) + 1;
+    for(i = 0; i < p[22]; i++) {
+        if(pos + 3 > len) {
+            return false;
+        }
+        uint32_t count = p[pos + 1] << 8 | p[pos + 2];
+        pos += 3;
+        if(!get_parameter_sets(p, len, &pos, count, fmt)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//Work out how to write a track as an elementary stream, from its first
+//sample entry. Returns false if it isn't AAC, H.264 or HEVC.
+bool get_es_format(atom_t *trak, es_format_t *fmt) {
+    atom_t *stsd = find_box(trak, "mdia/minf/stbl/stsd");
+    uint32_t box_size;
+    if(stsd == NULL || stsd->data_size < 16 || get_be32(stsd->data + 4) < 1) {
+        return false;
+    }
+    const unsigned char *entry = stsd->data + 8;
+    uint32_t size = get_be32(entry);
+    if(size < 16 || size > stsd->data_size - 8) {
+        return false;
+    }
+    fmt->parameter_sets.clear();
+    if(memcmp(entry + 4, "mp4a", 4) == 0 && size >= 36) {
+        //QuickTime sound description versions 1 and 2 are longer
+        int version = entry[16] << 8 | entry[17];
+        uint32_t skip = 36 + (version == 1 ? 16 : version == 2 ? 36 : 0);
+        const unsigned char *esds = find_entry_box(entry, size, skip, "esds", &box_size);
+        const unsigned char *dsi;
+        uint32_t dsi_len;
+        int object_type;
+        fmt->kind = ES_ADTS;
+        return esds != NULL && get_esds_config(esds, box_size, &object_type, &dsi, &dsi_len) &&
+               object_type == 0x40 && dsi != NULL && get_adts_header(dsi, dsi_len, fmt->adts);
+    }
+    if(size < 86) {
+        return false;
+    }
+    fmt->kind = ES_ANNEX_B;
+    if(memcmp(entry + 4, "avc1", 4) == 0 || memcmp(entry + 4, "avc3", 4) == 0) {
+        const unsigned char *avcc = find_entry_box(entry, size, 86, "avcC", &box_size);
+        return avcc != NULL && get_avcc_format(avcc, box_size, fmt);
+    }
+    if(memcmp(entry + 4, "hvc1", 4) == 0 || memcmp(entry + 4, "hev1", 4) == 0) {
+        const unsigned char *hvcc = find_entry_box(entry, size, 86, "hvcC", &box_size);
+        return hvcc != NULL && get_hvcc_format(hvcc, box_size, fmt);
+    }
+    return false;
+}
+
+//Which samples are sync samples, from stss. Without an stss, they
+//all are.
+void get_sync_samples(atom_t *trak, uint32_t count, std::vector<bool> &sync) {
+    atom_t *stss = find_box(trak, "mdia/minf/stbl/stss");
+    uint32_t i;
+    if(stss == NULL || stss->data_size < 8 || 8 + 4 * (uint64_t)get_be32(stss->data + 4) > stss->data_size) {
+        sync.assign(count, true);
+        return;
+    }
+    sync.assign(count, false);
+    for(i = 0; i < get_be32(stss->data + 4); i++) {
+        uint32_t sample = get_be32(stss->data + 8 + 4 * i);
+        if(sample >= 1 && sample <= count) {
+            sync[sample - 1] = true;
+        }
+    }
+}
+
+void push_iovec(std::vector<struct iovec> &iov, const void *base, size_t len) {
+    struct iovec v;
+    v.iov_base = (void*)base;
+    v.iov_len = len;
+    iov.push_back(v);
+}
+
+//Write the samples of a track from the file in, in_size bytes long, to
+//out as an elementary stream. Returns 0, or -1 with the reason printed.
+int export_track(int in, uint64_t in_size, atom_t *trak, const es_format_t *fmt, int out) {
+    std::vector<chunk_t> chunks;
+    sample_index_t index;
+    std::vector<bool> sync;
+    std::vector<unsigned char> buf, headers;
+    std::vector<struct iovec> iov;
+    uint32_t i, k, j;
+    if(get_track_chunks(trak, chunks) != 0 || index_sample_sizes(trak, &index) != 0) {
+        fprintf(stderr, "Track %u has unreadable sample tables\n", get_track_id(trak));
+        return -1;
+    }
+    get_sync_samples(trak, index.count, sync);
+
+    for(i = 0; i < chunks.size(); i++) {
+        const chunk_t &chunk = chunks[i];
+        check_cancel();
+        if(chunk.offset > in_size || chunk.size > in_size - chunk.offset) {
+            fprintf(stderr, "Chunk %u is past the end of the file\n", i + 1);
+            return -1;
+        }
+        buf.resize(chunk.size);
+        headers.resize(7 * (size_t)chunk.samples);
+        if(pread_all(in, buf.data(), chunk.size, chunk.offset) != 0) {
+            fprintf(stderr, "Chunk %u is past the end of the file\n", i + 1);
+            return -1;
+        }
+        iov.clear();
+        uint64_t at = 0;
+        for(k = 0; k < chunk.samples; k++) {
+            uint32_t sample = chunk.first_sample + k;
+            uint32_t size = sample_size(&index, sample);
+            const unsigned char *p = buf.data() + at;
+            at += size;
+            if(fmt->kind == ES_ADTS) {
+                uint32_t frame = size + 7;
+                unsigned char *header = &headers[7 * k];
+                if(frame > 0x1fff) {
+                    fprintf(stderr, "Sample %u is too big for an ADTS frame\n", sample + 1);
+                    return -1;
+                }
+                memcpy(header, fmt->adts, 7);
+                header[3] |= frame >> 11;
+                header[4] = frame >> 3;
+                header[5] |= (frame & 7) << 5;
+                push_iovec(iov, header, 7);
+                push_iovec(iov, p, size);
+                continue;
+            }
+            if(sync[sample]) {
+                push_iovec(iov, fmt->parameter_sets.data(), fmt->parameter_sets.size());
+            }
+            for(uint32_t n = 0; n < size; ) {
+                uint32_t nal = 0;
+                if(size - n < (uint32_t)fmt->length_size) {
+                    fprintf(stderr, "Sample %u has a truncated NAL unit length\n", sample + 1);
+                    return -1;
+                }
+                for(j = 0; j < (uint32_t)fmt->length_size; j++) {
+                    nal = nal << 8 | p[n++];
+                }
+                if(nal > size - n) {
+                    fprintf(stderr, "Sample %u has a NAL unit longer than the sample\n", sample + 1);
+                    return -1;
+                }
+                push_iovec(iov, start_code, 4);
+                push_iovec(iov, p + n, nal);
+                n += nal;
+            }
+        }
+        if(writev_all(out, iov) != 0) {
+            fprintf(stderr, "Could not write the stream: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//m4mudex export-es [-t track] <file> <out|->
+int main_export_es(int argc, char **argv) {
+    std::vector<std::string> selectors;
+    es_format_t fmt;
+    atom_t *trak = NULL;
+    uint32_t i;
+    int arg = 0;
+    if(argc >= 2 && strcmp(argv[0], "-t") == 0) {
+        selectors.push_back(argv[1]);
+        arg = 2;
+    }
+    if(argc - arg < 2) {
+        usage();
+        exit(1);
+    }
+    const char *in_name = argv[arg];
+    const char *out_name = argv[arg + 1];
+    FILE *file = fopen(in_name, "rb");
+    if(file == NULL) {
+        fprintf(stderr, "Could not open %s\n", in_name);
+        exit(1);
+    }
+    source_t src = source_from_file(file);
+    if(!src.seekable) {
+        fprintf(stderr, "%s isn't a file\n", in_name);
+        exit(1);
+    }
+    atom_t *root = build_tree(&src);
+    atom_t *moov = find_box(root, "moov");
+
+    //The selected track, or the first one we can export
+    for(i = 0; moov != NULL && i < moov->children.size() && trak == NULL; i++) {
+        atom_t *child = moov->children[i];
+        if(!is_box(child, "trak")) {
+            continue;
+        }
+        if(selectors.empty() ? get_es_format(child, &fmt) : track_selected(child, selectors)) {
+            trak = child;
+        }
+    }
+    if(trak == NULL) {
+        fprintf(stderr, selectors.empty() ? "No AAC, H.264 or HEVC track in %s\n" : "No track %s in %s\n",
+                selectors.empty() ? in_name : selectors[0].c_str(), in_name);
+        exit(1);
+    }
+    if(!selectors.empty() && !get_es_format(trak, &fmt)) {
+        fprintf(stderr, "Track %u isn't AAC, H.264 or HEVC\n", get_track_id(trak));
+        exit(1);
+    }
+
+    int out = strcmp(out_name, "-") == 0 ? STDOUT_FILENO : open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(out < 0) {
+        fprintf(stderr, "Could not open %s for writing\n", out_name);
+        exit(1);
+    }
+    if(out != STDOUT_FILENO) {
+        cancel_cleanup.push_back(out_name);
+    }
+    if(export_track(fileno(file), src.limit, trak, &fmt, out) != 0 || close(out) != 0) {
+        if(out != STDOUT_FILENO) {
+            unlink(out_name);
+        }
+        exit(1);
+    }
+    cancel_cleanup.clear();
+    fclose(file);
+    free_tree(root);
+    return 0;
+}
+
+/* mux-adts goes the other way for AAC: it wraps an ADTS stream, as an
+ * encoder writes it, in an .m4a file with no metadata at all. The frame
+ * headers are scanned to build the sample tables, the moov goes first,
+ * and the frames, without their headers, follow in a single mdat, written
+ * with writev straight from the input buffer. The ADTS header is the only
+ * thing that's dropped; everything a decoder needs from it goes into the
+ * esds.
+ */
+typedef struct adts_frame_t {
+    uint64_t offset;    //of the raw data, after the header
+    uint32_t size;
+} adts_frame_t;
+
+//The fields of an ADTS header that have to be the same in every frame
+typedef struct adts_format_t {
+    int profile;
+    int rate_index;
+    int channels;
+} adts_format_t;
+
+//Read the ADTS header at p, if there's a complete frame there.
+//Returns the frame length, or 0.
+uint32_t get_adts_frame(const unsigned char *p, uint64_t avail, adts_format_t *format, uint32_t *header_size) {
+    if(avail < 7 || p[0] != 0xff || (p[1] & 0xf6) != 0xf0) {
+        return 0;
+    }
+    uint32_t len = (p[3] & 3) << 11 | p[4] << 3 | p[5] >> 5;
+    *header_size = (p[1] & 1) ? 7 : 9;
+    format->profile = p[2] >> 6;
+    format->rate_index = p[2] >> 2 & 0xf;
+    format->channels = (p[2] & 1) << 2 | p[3] >> 6;
+    //Only one raw data block per frame, so a frame is one sample
+    if(len <= *header_size || len > avail || (p[6] & 3) != 0 || format->rate_index > 12) {
+        return 0;
+    }
+    return len;
+}
+
+//Let go of the pages of a mapped file up to upto, which have been read
+//and won't be again soon, so the mapping doesn't stay resident as a
+//whole. base is page aligned.
+void drop_behind(const unsigned char *base, uint64_t upto) {
+    static long page = sysconf(_SC_PAGESIZE);
+    upto -= upto % page;
+    if(upto > 0) {
+        madvise((void*)base, upto, MADV_DONTNEED);
+    }
+}
+
+/* An ADTS input that's a regular file is mapped rather than read into
+ * memory, and the pages behind the scan and the write are let go every
+ * ADTS_WINDOW bytes, so the resident size stays about the same however
+ * long the stream is. A pipe still has to be read in whole.
+ */
+#define ADTS_WINDOW (8 << 20)
+
+//Find the frames in an ADTS stream. Anything between frames that isn't
+//one, such as an ID3 tag, is skipped: the next candidate sync word is
+//found with memchr, and accepted if another frame (or the end) follows.
+//If buf is a mapped file, the pages scanned are dropped as it goes.
+//Returns the number of bytes skipped, or -1 if the format changes.
+int64_t scan_adts(const unsigned char *buf, uint64_t len, bool mapped, std::vector<adts_frame_t> &frames,
+                  adts_format_t *format) {
+    adts_format_t f, next;
+    uint32_t header_size, next_header_size;
+    uint64_t pos = 0;
+    uint64_t dropped = 0;
+    int64_t skipped = 0;
+    while(pos < len) {
+        if(mapped && pos - dropped >= ADTS_WINDOW) {
+            drop_behind(buf, pos);
+            dropped = pos;
+        }
+        uint32_t frame = get_adts_frame(buf + pos, len - pos, &f, &header_size);
+        bool found = frame > 0 &&
+                     (pos + frame == len || !frames.empty() ||
+                      get_adts_frame(buf + pos + frame, len - pos - frame, &next, &next_header_size) > 0);
+        if(!found) {
+            const unsigned char *sync = (const unsigned char*)memchr(buf + pos + 1, 0xff, len - pos - 1);
+            uint64_t to = sync != NULL ? sync - buf : len;
+            skipped += to - pos;
+            pos = to;
+            continue;
+        }
+        if(frames.empty()) {
+            *format = f;
+        } else if(f.profile != format->profile || f.rate_index != format->rate_index ||
+                  f.channels != format->channels) {
+            fprintf(stderr, "The stream changes format at frame %zu\n", frames.size() + 1);
+            return -1;
+        }
+        adts_frame_t entry = { pos + header_size, frame - header_size };
+        frames.push_back(entry);
+        pos += frame;
+    }
+    return skipped;
+}
+
+//An MPEG-4 descriptor, all of which are short enough here for a
+//one-byte length.
+std::string make_descriptor(int tag, const std::string &payload) {
+    return std::string(1, (char)tag) + std::string(1, (char)payload.size()) + payload;
+}
+
+//The sample entry for the stream, with an esds carrying the
+//AudioSpecificConfig ADTS had in its headers.
+std::string make_mp4a(const adts_format_t *format, uint32_t rate, uint32_t max_size,
+                      uint32_t max_bitrate, uint32_t avg_bitrate) {
+    std::string asc, config, es, entry;
+    append_be16(asc, (format->profile + 1) << 11 | format->rate_index << 7 | format->channels << 3);
+    config += (char)0x40;   //MPEG-4 audio
+    config += (char)0x15;   //an audio stream
+    config += (char)(max_size >> 16);
+    append_be16(config, max_size);
+    append_be32(config, max_bitrate);
+    append_be32(config, avg_bitrate);
+    append_be16(es, 1);     //ES_ID
+    es += (char)0;
+    es += make_descriptor(4, config + make_descriptor(5, asc));
+    es += make_descriptor(6, std::string(1, (char)2));
+    std::string esds = make_full_box("esds", 0, make_descriptor(3, es));
+
+    entry += std::string(6, '\0');
+    append_be16(entry, 1);  //data reference index
+    entry += std::string(8, '\0');
+    append_be16(entry, format->channels > 0 ? format->channels : 2);
+    append_be16(entry, 16);
+    append_be32(entry, 0);
+    append_be32(entry, rate <= 0xffff ? rate << 16 : 0);
+    return make_box("mp4a", entry + esds);
+}
+
+//The moov for frames stored one after another from mdat_start, in
+//chunks of about a second each.
+std::string make_adts_moov(const std::vector<adts_frame_t> &frames, const adts_format_t *format,
+                           uint64_t mdat_start) {
+    uint32_t rate = aac_sample_rates[format->rate_index];
+    uint32_t count = frames.size();
+    uint64_t duration = (uint64_t)count * 1024;
+    uint32_t per_chunk = (rate + 1023) / 1024;
+    uint32_t chunks = (count + per_chunk - 1) / per_chunk;
+    uint64_t total = 0, window = 0, peak = 0;
+    uint32_t max_size = 0, i;
+    bool wide = false;
+    std::string p;
+
+    for(i = 0; i < count; i++) {
+        total += frames[i].size;
+        max_size = frames[i].size > max_size ? frames[i].size : max_size;
+        window += frames[i].size;
+        if(i >= per_chunk) {
+            window -= frames[i - per_chunk].size;
+        }
+        peak = window > peak ? window : peak;
+    }
+    wide = mdat_start + total > UINT32_MAX;
+    double seconds = duration > 0 ? (double)duration / rate : 1;
+
+    p.clear();
+    append_be32(p, 1);
+    append_be32(p, count);
+    append_be32(p, 1024);
+    std::string stts = make_full_box("stts", 0, p);
+    p.clear();
+    append_be32(p, count % per_chunk != 0 && chunks > 1 ? 2 : 1);
+    append_be32(p, 1);
+    append_be32(p, count < per_chunk ? count : per_chunk);
+    append_be32(p, 1);
+    if(count % per_chunk != 0 && chunks > 1) {
+        append_be32(p, chunks);
+        append_be32(p, count % per_chunk);
+        append_be32(p, 1);
+    }
+    std::string stsc = make_full_box("stsc", 0, p);
+    p.clear();
+    append_be32(p, 0);
+    append_be32(p, count);
+    for(i = 0; i < count; i++) {
+        append_be32(p, frames[i].size);
+    }
+    std::string stsz = make_full_box("stsz", 0, p);
+    p.clear();
+    append_be32(p, chunks);
+    uint64_t offset = mdat_start;
+    for(i = 0; i < count; i++) {
+        if(i % per_chunk == 0) {
+            if(wide) {
+                append_be64(p, offset);
+            } else {
+                append_be32(p, offset);
+            }
+        }
+        offset += frames[i].size;
+    }
+    std::string stco = make_full_box(wide ? "co64" : "stco", 0, p);
+    p.clear();
+    append_be32(p, 1);
+    std::string stsd = make_full_box("stsd", 0, p + make_mp4a(format, rate, max_size,
+                                                               peak * 8 * rate / ((uint64_t)per_chunk * 1024),
+                                                               total * 8 / seconds));
+    std::string stbl = make_box("stbl", stsd + stts + stsc + stsz + stco);
+
+    p.clear();
+    append_be32(p, 1);
+    std::string dinf = make_box("dinf", make_full_box("dref", 0, p + make_full_box("url ", 1, "")));
+    std::string minf = make_box("minf", make_full_box("smhd", 0, std::string(4, '\0')) + dinf + stbl);
+    std::string hdlr = make_full_box("hdlr", 0, std::string(4, '\0') + "soun" + std::string(12, '\0') +
+                                     "SoundHandler" + std::string(1, '\0'));
+    p.clear();
+    append_be32(p, 0);
+    append_be32(p, 0);
+    append_be32(p, rate);
+    append_be32(p, duration <= UINT32_MAX ? duration : UINT32_MAX);
+    append_be16(p, 0x55c4);     //"und"
+    append_be16(p, 0);
+    std::string mdia = make_box("mdia", make_full_box("mdhd", 0, p) + hdlr + minf);
+
+    //The movie and the track share the sample rate as their timescale
+    std::string matrix;
+    append_be32(matrix, 0x10000); append_be32(matrix, 0); append_be32(matrix, 0);
+    append_be32(matrix, 0); append_be32(matrix, 0x10000); append_be32(matrix, 0);
+    append_be32(matrix, 0); append_be32(matrix, 0); append_be32(matrix, 0x40000000);
+    p.clear();
+    append_be32(p, 0);
+    append_be32(p, 0);
+    append_be32(p, 1);          //track ID
+    append_be32(p, 0);
+    append_be32(p, duration <= UINT32_MAX ? duration : UINT32_MAX);
+    p += std::string(8, '\0');
+    append_be16(p, 0);
+    append_be16(p, 0);
+    append_be16(p, 0x0100);     //full volume
+    append_be16(p, 0);
+    p += matrix;
+    append_be32(p, 0);
+    append_be32(p, 0);
+    std::string trak = make_box("trak", make_full_box("tkhd", 7, p) + mdia);
+    p.clear();
+    append_be32(p, 0);
+    append_be32(p, 0);
+    append_be32(p, rate);
+    append_be32(p, duration <= UINT32_MAX ? duration : UINT32_MAX);
+    append_be32(p, 0x10000);    //rate 1.0
+    append_be16(p, 0x0100);     //volume 1.0
+    p += std::string(10, '\0');
+    p += matrix;
+    p += std::string(24, '\0');
+    append_be32(p, 2);          //next track ID
+    return make_box("moov", make_full_box("mvhd", 0, p) + trak);
+}
+
+//Read all of a file, or a stream to its end, into a new buffer.
+//Returns NULL if it can't be read.
+unsigned char *read_all(FILE *file, uint64_t *len) {
+    struct stat st;
+    if(fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode)) {
+        *len = st.st_size;
+        return read_whole(fileno(file), st.st_size);
+    }
+    size_t cap = 1 << 20;
+    unsigned char *buf = (unsigned char*)malloc(cap);
+    *len = 0;
+    size_t n;
+    while((n = fread(buf + *len, 1, cap - *len, file)) > 0) {
+        *len += n;
+        if(*len == cap) {
+            cap *= 2;
+            buf = (unsigned char*)realloc(buf, cap);
+        }
+        check_cancel();
+    }
+    if(ferror(file)) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+//m4mudex mux-adts <in.aac|-> <out.m4a|->
+int main_mux_adts(int argc, char **argv) {
+    std::vector<adts_frame_t> frames;
+    std::vector<struct iovec> iov;
+    adts_format_t format;
+    uint64_t len;
+    uint32_t i;
+    if(argc < 2) {
+        usage();
+        exit(1);
+    }
+    FILE *in = open_arg(argv[0], "rb");
+    unsigned char *buf = NULL;
+    struct stat st;
+    bool mapped = false;
+    if(in != NULL && fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        len = st.st_size;
+        void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+        if(map != MAP_FAILED) {
+            buf = (unsigned char*)map;
+            mapped = true;
+            madvise(map, len, MADV_SEQUENTIAL);
+        }
+    }
+    if(in != NULL && !mapped) {
+        buf = read_all(in, &len);
+    }
+    if(buf == NULL) {
+        fprintf(stderr, "Could not read %s\n", argv[0]);
+        exit(1);
+    }
+    int64_t skipped = scan_adts(buf, len, mapped, frames, &format);
+    if(skipped < 0) {
+        exit(1);
+    }
+    if(frames.empty()) {
+        fprintf(stderr, "No ADTS frames in %s\n", argv[0]);
+        exit(1);
+    }
+    if(skipped > 0) {
+        fprintf(stderr, "Skipped %lld bytes that weren't ADTS frames\n", (long long)skipped);
+    }
+
+    //The moov's size doesn't depend on where the mdat starts, except
+    //for choosing co64, so lay it out once to find out.
+    std::string ftyp = make_box("ftyp", std::string("M4A \0\0\0\0M4A mp42isom", 20));
+    uint64_t total = 0;
+    for(i = 0; i < frames.size(); i++) {
+        total += frames[i].size;
+    }
+    bool large = total + 8 > UINT32_MAX;
+    uint64_t head = ftyp.size() + make_adts_moov(frames, &format, 0).size();
+    std::string moov = make_adts_moov(frames, &format, head + (large ? 16 : 8));
+    if(ftyp.size() + moov.size() != head) {
+        moov = make_adts_moov(frames, &format, ftyp.size() + moov.size() + (large ? 16 : 8));
+    }
+    std::string mdat;
+    if(large) {
+        append_be32(mdat, 1);
+        mdat += "mdat";
+        append_be64(mdat, total + 16);
+    } else {
+        append_be32(mdat, total + 8);
+        mdat += "mdat";
+    }
+
+    int out = strcmp(argv[1], "-") == 0 ? STDOUT_FILENO : open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(out < 0) {
+        fprintf(stderr, "Could not open %s for writing\n", argv[1]);
+        exit(1);
+    }
+    if(out != STDOUT_FILENO) {
+        cancel_cleanup.push_back(argv[1]);
+    }
+    if(mapped) {
+        drop_behind(buf, len);
+    }
+    //The frames go out a window's worth at a time
+    push_iovec(iov, ftyp.data(), ftyp.size());
+    push_iovec(iov, moov.data(), moov.size());
+    push_iovec(iov, mdat.data(), mdat.size());
+    uint64_t window = 0;
+    int failed = 0;
+    for(i = 0; i < frames.size() && failed == 0; i++) {
+        push_iovec(iov, buf + frames[i].offset, frames[i].size);
+        window += frames[i].size;
+        if(window >= ADTS_WINDOW || i + 1 == frames.size()) {
+            failed = writev_all(out, iov);
+            iov.clear();
+            window = 0;
+            if(mapped) {
+                drop_behind(buf, frames[i].offset + frames[i].size);
+            }
+        }
+    }
+    if(failed != 0 || close(out) != 0) {
+        fprintf(stderr, "Could not write %s\n", argv[1]);
+        if(out != STDOUT_FILENO) {
+            unlink(argv[1]);
+        }
+        exit(1);
+    }
+    cancel_cleanup.clear();
+    if(mapped) {
+        munmap(buf, len);
+    } else {
+        free(buf);
+    }
+    return 0;
+}
+
+//Check that a stripped file is well formed: its boxes exactly tile the
+//file, none of them is a meta box, and every chunk of every track holds
+//the same bytes as the corresponding chunk of the original. Tracks
+//matching the dropped selectors are expected to be gone.
+//Prints what's wrong, and returns the number of problems found.
+int verify_tree_rec(atom_t *node) {
+    uint32_t i;
+    int problems = 0;
+    if(is_metadata_box(node)) {
+        printf("%.4s box left at %llu\n", node->name, (unsigned long long)node->offset);
+        problems++;
+    }
+    if(node->parent != NULL && box_type(node->name)->full_box && node->data_size < 4) {
+        printf("%.4s box at %llu is too short for its version and flags\n",
+               node->name, (unsigned long long)node->offset);
+        problems++;
+    }
+    for(i = 0; i < node->children.size(); i++) {
+        problems += verify_tree_rec(node->children[i]);
+    }
+    return problems;
+}
+
+bool same_bytes(source_t *a, uint64_t a_off, source_t *b, uint64_t b_off, uint64_t len) {
+    unsigned char a_buf[65536], b_buf[65536];
+    if(source_seek(a, a_off) != 0 || source_seek(b, b_off) != 0) {
+        return false;
+    }
+    while(len > 0) {
+        size_t n = len > sizeof(a_buf) ? sizeof(a_buf) : len;
+        if(source_read(a, a_buf, n) != n || source_read(b, b_buf, n) != n ||
+           memcmp(a_buf, b_buf, n) != 0) {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+//Check that every chunk of track b holds the same bytes as the
+//corresponding chunk of track a. Prints what's wrong to report, and
+//returns the number of problems found.
+int compare_track_media(atom_t *a, source_t *a_src, atom_t *b, source_t *b_src,
+                        uint32_t track, FILE *report) {
+    std::vector<chunk_t> a_chunks, b_chunks;
+    int problems = 0;
+    uint32_t j;
+    if(get_track_chunks(a, a_chunks) != 0 || get_track_chunks(b, b_chunks) != 0) {
+        fprintf(report, "Track %u has unreadable sample tables\n", track);
+        return 1;
+    }
+    if(a_chunks.size() != b_chunks.size()) {
+        fprintf(report, "Track %u chunk count changed\n", track);
+        return 1;
+    }
+    //A range can't differ from itself, so there's no need to read it
+    struct stat a_st, b_st;
+    bool same_file = fstat(fileno(a_src->file), &a_st) == 0 && fstat(fileno(b_src->file), &b_st) == 0 &&
+                     a_st.st_dev == b_st.st_dev && a_st.st_ino == b_st.st_ino;
+    for(j = 0; j < a_chunks.size(); j++) {
+        if(same_file && a_chunks[j].offset == b_chunks[j].offset && a_chunks[j].size == b_chunks[j].size) {
+            continue;
+        }
+        if(a_chunks[j].size != b_chunks[j].size ||
+           b_chunks[j].offset + b_chunks[j].size > b_src->limit ||
+           !same_bytes(a_src, a_chunks[j].offset, b_src, b_chunks[j].offset, a_chunks[j].size)) {
+            fprintf(report, "Track %u chunk %u doesn't match the original\n", track, j + 1);
+            problems++;
+        }
+    }
+    return problems;
+}
+
+int verify_output(const char *orig_name, const char *out_name,
+                  const std::vector<std::string> &dropped) {
+    FILE *orig_file = fopen(orig_name, "rb");
+    FILE *out_file = fopen(out_name, "rb");
+    int problems = 0;
+    uint32_t i;
+    if(orig_file == NULL || out_file == NULL) {
+        printf("Could not open %s and %s\n", orig_name, out_name);
+        return 1;
+    }
+    source_t orig_src = source_from_file(orig_file);
+    source_t out_src = source_from_file(out_file);
+    atom_t *orig = build_tree(&orig_src);
+    atom_t *out = build_tree(&out_src);
+
+    uint64_t end = 0;
+    for(i = 0; i < out->children.size(); i++) {
+        end += out->children[i]->len;
+    }
+    if(end != out_src.limit) {
+        printf("Boxes cover %llu bytes of a %llu byte file\n",
+               (unsigned long long)end, (unsigned long long)out_src.limit);
+        problems++;
+    }
+    problems += verify_tree_rec(out);
+
+    atom_t *orig_moov = find_box(orig, "moov");
+    atom_t *out_moov = find_box(out, "moov");
+    if(orig_moov == NULL || out_moov == NULL) {
+        printf("No moov box to compare\n");
+        return problems + 1;
+    }
+    std::vector<atom_t*> orig_traks, out_traks;
+    for(i = 0; i < orig_moov->children.size(); i++) {
+        if(is_box(orig_moov->children[i], "trak") &&
+           !track_selected(orig_moov->children[i], dropped)) {
+            orig_traks.push_back(orig_moov->children[i]);
+        }
+    }
+    for(i = 0; i < out_moov->children.size(); i++) {
+        if(out_moov->children[i]->active && is_box(out_moov->children[i], "trak")) {
+            out_traks.push_back(out_moov->children[i]);
+        }
+    }
+    if(orig_traks.size() != out_traks.size()) {
+        printf("Track count changed from %zu to %zu\n", orig_traks.size(), out_traks.size());
+        return problems + 1;
+    }
+    for(i = 0; i < orig_traks.size(); i++) {
+        problems += compare_track_media(orig_traks[i], &orig_src, out_traks[i], &out_src, i + 1, stdout);
+    }
+    fclose(orig_file);
+    fclose(out_file);
+    return problems;
+}
+
+/* diff compares two files box by box. Boxes are matched by their path,
+ * with an index where a box has several siblings of the same type
+ * (moov/udta/meta[2]) and tracks known by their ID (moov/trak[id=2]),
+ * and the boxes held in memory are compared byte for byte. Media data isn't compared as a whole: the chunks of each
+ * track are compared with the chunks of the track with the same ID in
+ * the other file, wherever each file keeps them, so two files whose
+ * boxes moved around still compare as carrying the same media.
+ */
+typedef struct diff_t {
+    FILE *out;
+    int changes;
+} diff_t;
+
+//A box's path component, with non-printable bytes (the © of QuickTime
+//text atoms, say) escaped.
+std::string box_label(const char *name, int index) {
+    std::string label;
+    char buf[16];
+    for(int i = 0; i < 4; i++) {
+        unsigned char c = name[i];
+        if(c >= 0x20 && c < 0x7f) {
+            label += c;
+        } else {
+            snprintf(buf, sizeof(buf), "\\x%02x", c);
+            label += buf;
+        }
+    }
+    if(index > 1) {
+        snprintf(buf, sizeof(buf), "[%d]", index);
+        label += buf;
+    }
+    return label;
+}
+
+//The label of each child, numbering siblings of the same type. Tracks
+//are labeled by track ID instead, so removing one doesn't make all the
+//ones after it look changed.
+void child_labels(atom_t *node, std::vector<std::string> &labels) {
+    uint32_t i, j;
+    char buf[32];
+    labels.clear();
+    for(i = 0; i < node->children.size(); i++) {
+        int index = 1;
+        if(is_box(node->children[i], "trak")) {
+            snprintf(buf, sizeof(buf), "trak[id=%u]", get_track_id(node->children[i]));
+            labels.push_back(buf);
+            continue;
+        }
+        for(j = 0; j < i; j++) {
+            index += memcmp(node->children[j]->name, node->children[i]->name, 4) == 0;
+        }
+        labels.push_back(box_label(node->children[i]->name, index));
+    }
+}
+
+bool is_container(const atom_t *node) {
+    return box_type(node->name)->kind == BOX_CONTAINER;
+}
+
+void diff_boxes(atom_t *a, atom_t *b, const std::string &path, diff_t *d);
+
+void diff_children(atom_t *a, atom_t *b, const std::string &path, diff_t *d) {
+    std::vector<std::string> a_labels, b_labels;
+    uint32_t i, j;
+    child_labels(a, a_labels);
+    child_labels(b, b_labels);
+    for(i = 0; i < a_labels.size(); i++) {
+        std::string child_path = path + a_labels[i];
+        for(j = 0; j < b_labels.size() && b_labels[j] != a_labels[i]; j++) {
+        }
+        if(j == b_labels.size()) {
+            fprintf(d->out, "- %s (%llu bytes)\n", child_path.c_str(),
+                    (unsigned long long)a->children[i]->len);
+            d->changes++;
+        } else {
+            diff_boxes(a->children[i], b->children[j], child_path, d);
+        }
+    }
+    for(j = 0; j < b_labels.size(); j++) {
+        if(std::find(a_labels.begin(), a_labels.end(), b_labels[j]) == a_labels.end()) {
+            fprintf(d->out, "+ %s%s (%llu bytes)\n", path.c_str(), b_labels[j].c_str(),
+                    (unsigned long long)b->children[j]->len);
+            d->changes++;
+        }
+    }
+}
+
+void diff_boxes(atom_t *a, atom_t *b, const std::string &path, diff_t *d) {
+    if(is_container(a)) {
+        diff_children(a, b, path + "/", d);
+        return;
+    }
+    if(a->deferred || is_padding_box(a->name) || a->data == NULL || b->data == NULL) {
+        //Only the size of media data and padding matters here
+        if(a->data_size != b->data_size) {
+            fprintf(d->out, "~ %s size %llu -> %llu\n", path.c_str(),
+                    (unsigned long long)a->len, (unsigned long long)b->len);
+            d->changes++;
+        }
+        return;
+    }
+    if(a->data_size == b->data_size && memcmp(a->data, b->data, a->data_size) == 0) {
+        return;
+    }
+    d->changes++;
+    offset_table_t table;
+    if(get_offset_table(a, &table) && a->data_size == b->data_size) {
+        fprintf(d->out, "~ %s offsets moved\n", path.c_str());
+    } else if(a->data_size != b->data_size) {
+        fprintf(d->out, "~ %s size %llu -> %llu\n", path.c_str(),
+                (unsigned long long)a->len, (unsigned long long)b->len);
+    } else {
+        fprintf(d->out, "~ %s contents changed\n", path.c_str());
+    }
+}
+
+//m4mudex diff <a> <b>
+//Exits with 0 if the files have the same boxes and media, 1 if the
+//boxes differ but every track in both carries the same media, and 2 if
+//the media differs or a file can't be read.
+int main_diff(int argc, char **argv) {
+    uint32_t i, j;
+    if(argc < 2) {
+        usage();
+        exit(2);
+    }
+    FILE *a_file = fopen(argv[0], "rb");
+    FILE *b_file = fopen(argv[1], "rb");
+    if(a_file == NULL || b_file == NULL) {
+        printf("Could not open %s and %s\n", argv[0], argv[1]);
+        return 2;
+    }
+    source_t a_src = source_from_file(a_file);
+    source_t b_src = source_from_file(b_file);
+    atom_t *a = build_tree(&a_src);
+    atom_t *b = build_tree(&b_src);
+    diff_t d = { stdout, 0 };
+    diff_children(a, b, "", &d);
+
+    atom_t *a_moov = find_box(a, "moov");
+    atom_t *b_moov = find_box(b, "moov");
+    int media_problems = 0;
+    for(i = 0; a_moov != NULL && b_moov != NULL && i < a_moov->children.size(); i++) {
+        atom_t *a_trak = a_moov->children[i];
+        if(!is_box(a_trak, "trak")) {
+            continue;
+        }
+        for(j = 0; j < b_moov->children.size(); j++) {
+            atom_t *b_trak = b_moov->children[j];
+            if(is_box(b_trak, "trak") && get_track_id(b_trak) == get_track_id(a_trak)) {
+                media_problems += compare_track_media(a_trak, &a_src, b_trak, &b_src,
+                                                      get_track_id(a_trak), stdout);
+            }
+        }
+    }
+    if(a_moov == NULL || b_moov == NULL) {
+        printf("media: no moov box to compare\n");
+        media_problems++;
+    } else {
+        printf("media: %s\n", media_problems > 0 ? "differs" : "equivalent");
+    }
+    fclose(a_file);
+    fclose(b_file);
+    free_tree(a);
+    free_tree(b);
+    return media_problems > 0 ? 2 : d.changes > 0 ? 1 : 0;
+}
+
+//Write the sidecar describing the input of a tee'd run.
+int write_sidecar(const char *filename, const char *in_name, uint64_t in_size,
+                  sha256_t *hash, uint64_t removed) {
+    unsigned char digest[32];
+    char hex[65];
+    FILE *sidecar = fopen(filename, "w");
+    if(sidecar == NULL) {
+        return -1;
+    }
+    sha256_final(hash, digest);
+    sha256_hex(digest, hex);
+    fprintf(sidecar, "input %s\n", in_name);
+    fprintf(sidecar, "size %llu\n", (unsigned long long)in_size);
+    fprintf(sidecar, "sha256 %s\n", hex);
+    fprintf(sidecar, "removed %llu\n", (unsigned long long)removed);
+    return fclose(sidecar);
+}
+
+/* With -m, a Merkle tree of SHA-256 hashes over the media data is written
+ * to a sidecar, so a copy can be checked, or brought back in step, a
+ * chunk at a time. The leaves are the chunks of every track, in the
+ * order they appear in the output; each leaf is the hash of a zero byte
+ * and the chunk, and each node above is the hash of a one byte and its
+ * two children (as in RFC 6962), with an odd node carried up as it is.
+ *
+ * Chunks are hashed from the input by worker threads while the output
+ * is being written, since their bytes don't change.
+ */
+typedef struct merkle_leaf_t {
+    uint64_t src_offset;
+    uint64_t out_offset;
+    uint64_t size;
+    unsigned char digest[32];
+} merkle_leaf_t;
+
+typedef struct merkle_job_t {
+    int fd;
+    std::vector<merkle_leaf_t> *leaves;
+    uint32_t next;
+    //Set by any worker that can't read its chunk; read and written
+    //with atomics
+    bool failed;
+} merkle_job_t;
+
+bool leaf_before(const merkle_leaf_t &a, const merkle_leaf_t &b) {
+    return a.out_offset < b.out_offset;
+}
+
+//The chunks of every track in the tree, track by track.
+void get_all_chunks(atom_t *root, std::vector<chunk_t> &chunks) {
+    atom_t *moov = find_box(root, "moov");
+    uint32_t i;
+    chunks.clear();
+    for(i = 0; moov != NULL && i < moov->children.size(); i++) {
+        std::vector<chunk_t> track_chunks;
+        atom_t *trak = moov->children[i];
+        if(trak->active && is_box(trak, "trak") &&
+           get_track_chunks(trak, track_chunks) == 0) {
+            chunks.insert(chunks.end(), track_chunks.begin(), track_chunks.end());
+        }
+    }
+}
+
+//Hash leaves until there are none left. Each thread takes the next
+//unclaimed leaf, so they stay busy whatever the chunk sizes.
+void *merkle_worker(void *arg) {
+    merkle_job_t *job = (merkle_job_t*)arg;
+    unsigned char buf[65536];
+    while(true) {
+        uint32_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(i >= job->leaves->size() || cancelled || __atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+            return NULL;
+        }
+        merkle_leaf_t &leaf = (*job->leaves)[i];
+        sha256_t hash;
+        unsigned char prefix = 0;
+        sha256_init(&hash);
+        sha256_update(&hash, &prefix, 1);
+        for(uint64_t done = 0; done < leaf.size; ) {
+            size_t want = leaf.size - done > sizeof(buf) ? sizeof(buf) : leaf.size - done;
+            ssize_t got = pread(job->fd, buf, want, leaf.src_offset + done);
+            if(got < 0 && errno == EINTR) {
+                continue;
+            }
+            if(got <= 0) {
+                __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            sha256_update(&hash, buf, got);
+            done += got;
+        }
+        sha256_final(&hash, leaf.digest);
+    }
+}
+
+//Start hashing the leaves on up to one thread per CPU.
+//Returns the number of threads started.
+int merkle_start(merkle_job_t *job, pthread_t *threads, int max_threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cpus < 1 ? 1 : cpus > max_threads ? max_threads : cpus;
+    int i, started = 0;
+    for(i = 0; i < count; i++) {
+        if(pthread_create(&threads[i], NULL, merkle_worker, job) == 0) {
+            started++;
+        }
+    }
+    if(started == 0) {
+        //No threads to be had; do it on this one
+        merkle_worker(job);
+    }
+    return started;
+}
+
+void merkle_root(const std::vector<merkle_leaf_t> &leaves, unsigned char root[32]) {
+    std::vector<unsigned char> level;
+    uint32_t i;
+    if(leaves.empty()) {
+        sha256_t hash;
+        sha256_init(&hash);
+        sha256_final(&hash, root);
+        return;
+    }
+    for(i = 0; i < leaves.size(); i++) {
+        level.insert(level.end(), leaves[i].digest, leaves[i].digest + 32);
+    }
+    while(level.size() > 32) {
+        std::vector<unsigned char> up;
+        for(i = 0; i < level.size(); i += 64) {
+            if(i + 32 == level.size()) {
+                up.insert(up.end(), level.begin() + i, level.end());
+                continue;
+            }
+            sha256_t hash;
+            unsigned char prefix = 1;
+            unsigned char digest[32];
+            sha256_init(&hash);
+            sha256_update(&hash, &prefix, 1);
+            sha256_update(&hash, &level[i], 64);
+            sha256_final(&hash, digest);
+            up.insert(up.end(), digest, digest + 32);
+        }
+        level.swap(up);
+    }
+    memcpy(root, &level[0], 32);
+}
+
+//Write the Merkle sidecar: the root, then each leaf's position and
+//size in the output and its hash.
+int write_merkle(const char *filename, const char *out_name, const std::vector<merkle_leaf_t> &leaves) {
+    unsigned char root[32];
+    char hex[65];
+    uint32_t i;
+    FILE *sidecar = fopen(filename, "w");
+    if(sidecar == NULL) {
+        return -1;
+    }
+    merkle_root(leaves, root);
+    sha256_hex(root, hex);
+    fprintf(sidecar, "output %s\n", out_name);
+    fprintf(sidecar, "chunks %zu\n", leaves.size());
+    fprintf(sidecar, "root %s\n", hex);
+    for(i = 0; i < leaves.size(); i++) {
+        sha256_hex(leaves[i].digest, hex);
+        fprintf(sidecar, "leaf %llu %llu %s\n", (unsigned long long)leaves[i].out_offset,
+                (unsigned long long)leaves[i].size, hex);
+    }
+    return fclose(sidecar);
+}
+
+/* With --cache <dir>, results are kept in a directory, under a key made
+ * from everything that decides them: the SHA-256 of the input, the
+ * options that change the output, and which m4mudex binary made them
+ * (its device, inode, size and modification time), so a rebuilt tool
+ * never hands out an old one's results. An input seen before then costs
+ * one pass to hash it, and its result is handed out from the cache with
+ * no parsing, rewriting or checking.
+ *
+ * A result is handed out as a reflink (a copy-on-write clone) where the
+ * file system supports it, and as a hard link where it doesn't, so the
+ * cache has to be on the same file system as the outputs. Cached files
+ * are read-only, and a run with --cache never writes through an existing
+ * output, in case it's one of those links: it writes a new file and
+ * renames it into place. For the same reason a result goes into the
+ * cache as a reflink or a copy of its own, never a link to the output.
+ */
+
+//Hash a whole file, from the start whatever its position.
+int hash_fd(int fd, sha256_t *h) {
+    std::vector<unsigned char> buf(1 << 20);
+    uint64_t offset = 0;
+    ssize_t n;
+    while((n = pread(fd, buf.data(), buf.size(), offset)) != 0) {
+        check_cancel();
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sha256_update(h, buf.data(), n);
+        offset += n;
+    }
+    return 0;
+}
+
+//The options that make a difference to the output, one to a line.
+std::string output_options(const std::vector<std::string> &dropped, const layout_t *layout) {
+    std::string ops;
+    char line[128];
+    uint32_t i;
+    for(i = 0; i < dropped.size(); i++) {
+        ops += "drop " + dropped[i] + "\n";
+    }
+    snprintf(line, sizeof(line), "align %llu %d\nsidx %d\nmfra %d\n", (unsigned long long)layout->align,
+             layout->align_chunks, layout->sidx, layout->mfra);
+    return ops + line;
+}
+
+void make_cache_key(const unsigned char input[32], const std::string &ops, char key[65]) {
+    unsigned char digest[32];
+    char tool[128] = "";
+    struct stat st;
+    sha256_t h;
+    if(stat("/proc/self/exe", &st) == 0) {
+        snprintf(tool, sizeof(tool), "tool %llu %llu %llu %lld.%09ld\n", (unsigned long long)st.st_dev,
+                 (unsigned long long)st.st_ino, (unsigned long long)st.st_size,
+                 (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+    }
+    sha256_init(&h);
+    sha256_update(&h, tool, strlen(tool));
+    sha256_update(&h, ops.data(), ops.size());
+    sha256_update(&h, input, 32);
+    sha256_final(&h, digest);
+    sha256_hex(digest, key);
+}
+
+//Copy the file from to a new file, to, with the given mode: a reflink
+//if the file system can, and otherwise a copy of the bytes. Never a
+//hard link, which anything writing to one name would write through to
+//the other.
+//Returns 0, or -1 on error.
+int clone_file(const char *from, const char *to, mode_t mode) {
+    std::vector<unsigned char> buf;
+    ssize_t n;
+    int in = open(from, O_RDONLY);
+    if(in < 0) {
+        return -1;
+    }
+    int out = open(to, O_WRONLY | O_CREAT | O_EXCL, mode);
+    if(out < 0) {
+        close(in);
+        return -1;
+    }
+    if(ioctl(out, FICLONE, in) == 0) {
+        close(in);
+        return close(out);
+    }
+    buf.resize(1 << 20);
+    while((n = read(in, buf.data(), buf.size())) != 0) {
+        std::vector<struct iovec> iov;
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n > 0) {
+            push_iovec(iov, buf.data(), n);
+        }
+        if(n < 0 || writev_all(out, iov) != 0) {
+            close(out);
+            close(in);
+            unlink(to);
+            return -1;
+        }
+    }
+    close(in);
+    return close(out);
+}
+
+//Hand out the cached result for a key as out, if there is one. It's
+//made under a name of its own and renamed into place, so out is never
+//left half written.
+//Returns 0, or -1 if it isn't in the cache or can't be copied.
+int cache_fetch(const char *dir, const char *key, const char *out) {
+    std::string path = std::string(dir) + "/" + key;
+    char tmp[32];
+    if(access(path.c_str(), F_OK) != 0) {
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), ".tmp.%d", (int)getpid());
+    std::string tmp_path = std::string(out) + tmp;
+    if(clone_file(path.c_str(), tmp_path.c_str(), 0644) != 0) {
+        return -1;
+    }
+    if(rename(tmp_path.c_str(), out) != 0) {
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+//Put a result in the cache under its key. It goes in under a name of
+//its own first, so a run looking it up never sees it half made.
+int cache_store(const char *dir, const char *key, const char *out) {
+    std::string path = std::string(dir) + "/" + key;
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), ".tmp.%d", (int)getpid());
+    std::string tmp_path = path + tmp;
+    if(clone_file(out, tmp_path.c_str(), 0444) != 0) {
+        return -1;
+    }
+    if(rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+//Strip the given file in place, without copying it.
+int main_in_place(const char *filename) {
+    int fd = open(filename, O_RDWR);
+    FILE *m4a_file = fd < 0 ? NULL : fdopen(dup(fd), "rb");
+    if (m4a_file == NULL) {
+        printf("Provide the name of an existing m4a file to modify\n");
+        exit(1);
+    }
+    source_t src = source_from_file(m4a_file);
+    atom_t* m4a_tree = build_tree(&src);
+    fclose(m4a_file);
+
+    printf("Original tree:\n");
+    print_tree(m4a_tree);
+    printf("\n");
+
+    int64_t released = strip_meta_in_place(m4a_tree, fd);
+    if(released < 0) {
+        printf("Could not modify %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    printf("Modified tree:\n");
+    print_tree(m4a_tree);
+    printf("\n");
+    printf("Released %lld bytes of padding\n", (long long)released);
+    close(fd);
+    return 0;
+}
+
+/* batch strips many files into one directory, each in an m4mudex
+ * process of its own. The files are grouped by the disk they're on, and
+ * each disk gets its own queue with its own limit on the jobs running at
+ * once, so one disk isn't thrashed while another sits idle. A spinning
+ * disk does best with a job at a time, as more only make its head seek
+ * between them; an SSD wants several to keep its queue full. With every
+ * disk busy at once, the total throughput grows with the number of disks.
+ *
+ * A file's disk is its st_dev, or for a partition, the whole disk it's
+ * on. Whether that spins comes from its queue/rotational in sysfs; a file
+ * system with no block device behind it (tmpfs, NFS) counts as an SSD.
+ */
+#define BATCH_HDD_JOBS 1
+#define BATCH_SSD_JOBS 4
+
+typedef struct batch_job_t {
+    const char *in;
+    std::string out;
+    uint32_t disk;
+    pid_t pid;
+} batch_job_t;
+
+typedef struct batch_disk_t {
+    dev_t dev;
+    bool rotational;
+    int limit;
+    std::vector<uint32_t> queue;
+    size_t next;
+    int running;
+} batch_disk_t;
+
+//The whole disk a device is on: a partition's parent, or the device
+//itself.
+dev_t get_disk(dev_t dev) {
+    char path[128];
+    unsigned int major_id, minor_id;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition", major(dev), minor(dev));
+    if(access(path, F_OK) != 0) {
+        return dev;
+    }
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev", major(dev), minor(dev));
+    FILE *file = fopen(path, "r");
+    if(file == NULL) {
+        return dev;
+    }
+    if(fscanf(file, "%u:%u", &major_id, &minor_id) == 2) {
+        dev = makedev(major_id, minor_id);
+    }
+    fclose(file);
+    return dev;
+}
+
+bool is_rotational(dev_t disk) {
+    char path[128];
+    int c = '0';
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(disk), minor(disk));
+    FILE *file = fopen(path, "r");
+    if(file != NULL) {
+        c = fgetc(file);
+        fclose(file);
+    }
+    return c == '1';
+}
+
+//Run m4mudex [options] <in> <out> for a job, with its tree listings
+//thrown away.
+pid_t batch_start(const batch_job_t *job, const std::vector<char*> &options) {
+    std::vector<char*> args;
+    args.push_back((char*)"m4mudex");
+    args.insert(args.end(), options.begin(), options.end());
+    args.push_back((char*)job->in);
+    args.push_back((char*)job->out.c_str());
+    args.push_back(NULL);
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if(null_fd >= 0) {
+            dup2(null_fd, 1);
+        }
+        execv("/proc/self/exe", args.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+//Stop every running job, then give up.
+void batch_cancel(std::vector<batch_job_t> &jobs) {
+    uint32_t i;
+    for(i = 0; i < jobs.size(); i++) {
+        if(jobs[i].pid > 0) {
+            kill(jobs[i].pid, SIGTERM);
+        }
+    }
+    while(wait(NULL) > 0 || errno == EINTR) {
+        //Until every job has exited
+    }
+    cancel_exit();
+}
+
+int main_batch(int argc, char **argv) {
+    std::vector<batch_job_t> jobs;
+    std::vector<batch_disk_t> disks;
+    std::vector<char*> options;
+    int hdd_jobs = BATCH_HDD_JOBS, ssd_jobs = BATCH_SSD_JOBS;
+    int arg = 0, running = 0, failed = 0;
+    uint32_t i, j;
+    struct stat st;
+
+    //Anything after -- is passed on to every job
+    for(i = 0; i < (uint32_t)argc; i++) {
+        if(strcmp(argv[i], "--") == 0) {
+            options.assign(argv + i + 1, argv + argc);
+            argc = i;
+            break;
+        }
+    }
+    for(; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        int n = atoi(argv[arg + 1]);
+        if(n <= 0) {
+            printf("Bad job count %s\n", argv[arg + 1]);
+            exit(1);
+        }
+        if(strcmp(argv[arg], "-j") == 0) {
+            hdd_jobs = ssd_jobs = n;
+        } else if(strcmp(argv[arg], "--hdd-jobs") == 0) {
+            hdd_jobs = n;
+        } else if(strcmp(argv[arg], "--ssd-jobs") == 0) {
+            ssd_jobs = n;
+        } else {
+            usage();
+            exit(1);
+        }
+    }
+    if(argc - arg < 2) {
+        usage();
+        exit(1);
+    }
+    const char *out_dir = argv[arg++];
+    if(stat(out_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("%s isn't a directory\n", out_dir);
+        exit(1);
+    }
+
+    //Each file goes in the output directory under its own name, queued
+    //on its disk
+    int total = argc - arg;
+    for(; arg < argc; arg++) {
+        const char *base = strrchr(argv[arg], '/');
+        batch_job_t job = { argv[arg], std::string(out_dir) + "/" + (base != NULL ? base + 1 : argv[arg]),
+                            0, 0 };
+        for(i = 0; i < jobs.size(); i++) {
+            if(jobs[i].out == job.out) {
+                printf("%s and %s would both be written to %s\n", jobs[i].in, job.in, job.out.c_str());
+                exit(1);
+            }
+        }
+        if(stat(job.in, &st) != 0) {
+            printf("%s: %s\n", job.in, strerror(errno));
+            failed++;
+            continue;
+        }
+        dev_t dev = get_disk(st.st_dev);
+        i = 0;
+        while(i < disks.size() && disks[i].dev != dev) {
+            i++;
+        }
+        if(i == disks.size()) {
+            batch_disk_t disk;
+            disk.dev = dev;
+            disk.rotational = is_rotational(dev);
+            disk.limit = disk.rotational ? hdd_jobs : ssd_jobs;
+            disk.next = 0;
+            disk.running = 0;
+            disks.push_back(disk);
+        }
+        job.disk = i;
+        disks[i].queue.push_back(jobs.size());
+        jobs.push_back(job);
+    }
+    for(i = 0; i < disks.size(); i++) {
+        printf("Disk %u:%u (%s): %zu files, %d at a time\n", major(disks[i].dev), minor(disks[i].dev),
+               disks[i].rotational ? "spinning" : "solid state", disks[i].queue.size(), disks[i].limit);
+    }
+
+    while(true) {
+        if(cancelled) {
+            batch_cancel(jobs);
+        }
+        //Keep every disk's queue as busy as it's allowed to be
+        for(i = 0; i < disks.size(); i++) {
+            batch_disk_t &disk = disks[i];
+            while(disk.running < disk.limit && disk.next < disk.queue.size()) {
+                batch_job_t &job = jobs[disk.queue[disk.next++]];
+                job.pid = batch_start(&job, options);
+                if(job.pid < 0) {
+                    printf("%s: could not start a job: %s\n", job.in, strerror(errno));
+                    failed++;
+                    continue;
+                }
+                disk.running++;
+                running++;
+            }
+        }
+        if(running == 0) {
+            break;
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if(pid < 0) {
+            continue;
+        }
+        j = 0;
+        while(j < jobs.size() && jobs[j].pid != pid) {
+            j++;
+        }
+        if(j == jobs.size()) {
+            continue;
+        }
+        jobs[j].pid = 0;
+        disks[jobs[j].disk].running--;
+        running--;
+        if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            printf("%s: stripped to %s\n", jobs[j].in, jobs[j].out.c_str());
+        } else {
+            printf("%s: failed (%s %d)\n", jobs[j].in, WIFEXITED(status) ? "exit status" : "signal",
+                   WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+            failed++;
+        }
+    }
+    if(failed > 0) {
+        printf("%d of %d files failed\n", failed, total);
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
     FILE *m4a_file;
     FILE *out_file;
     int meta_idx = 0;
+    bool in_place = false;
+    bool tar = false;
+    bool verify = false;
+    std::vector<FILE*> copies;
+    const char *sidecar_name = NULL;
+    const char *merkle_name = NULL;
+    const char *cache_dir = NULL;
+    int serve_port = 0;
+    std::vector<std::string> dropped;
+    layout_t layout = { 0, false, false, false };
+    static const struct option long_options[] = {
+        { "drop-track", required_argument, NULL, 'd' },
+        { "align", required_argument, NULL, 'a' },
+        { "align-chunks", no_argument, NULL, 'A' },
+        { "deadline", required_argument, NULL, 'T' },
+        { "small-file-max", required_argument, NULL, 'M' },
+        { "sidx", no_argument, NULL, 'x' },
+        { "mfra", no_argument, NULL, 'f' },
+        { "cache", required_argument, NULL, 'C' },
+        { NULL, 0, NULL, 0 }
+    };
+    double deadline = 0;
+    uint64_t small_file_max = SMALL_FILE_MAX;
+    int opt;
+
+    cancel_setup(0);
+    if(argc > 1 && strcmp(argv[1], "probe") == 0) {
+        return main_probe(argc - 2, argv + 2);
+    }
+    if(argc > 1 && strcmp(argv[1], "analyze") == 0) {
+        return main_analyze(argc - 2, argv + 2);
+    }
+    if(argc > 1 && strcmp(argv[1], "diff") == 0) {
+        return main_diff(argc - 2, argv + 2);
+    }
+    if(argc > 1 && strcmp(argv[1], "export-es") == 0) {
+        return main_export_es(argc - 2, argv + 2);
+    }
+    if(argc > 1 && strcmp(argv[1], "mux-adts") == 0) {
+        return main_mux_adts(argc - 2, argv + 2);
+    }
+    if(argc > 1 && strcmp(argv[1], "batch") == 0) {
+        return main_batch(argc - 2, argv + 2);
+    }
+
+    while((opt = getopt_long(argc, argv, "itVBc:s:m:S:d:a:A", long_options, NULL)) != -1) {
+        switch(opt) {
+        case 'a':
+            layout.align = strtoull(optarg, NULL, 0);
+            if(layout.align < 16 || (layout.align & (layout.align - 1)) != 0) {
+                printf("Alignment must be a power of two, at least 16, not %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'A':
+            layout.align_chunks = true;
+            break;
+        case 'x':
+            layout.sidx = true;
+            break;
+        case 'C':
+            cache_dir = optarg;
+            break;
+        case 'f':
+            layout.mfra = true;
+            break;
+        case 'T':
+            deadline = atof(optarg);
+            if(deadline <= 0) {
+                printf("Bad deadline %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'M':
+            small_file_max = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            if(strspn(optarg, "0123456789") != strlen(optarg) && strlen(optarg) != 4) {
+                printf("Select a track to drop by ID or by 4-letter handler type, not %s\n", optarg);
+                exit(1);
+            }
+            dropped.push_back(optarg);
+            break;
+        case 'B':
+            bench.enabled = true;
+            break;
+        case 'V':
+            verify = true;
+            break;
+        case 'c':
+            copies.push_back(fopen(optarg, "wb"));
+            if(copies.back() == NULL) {
+                printf("Could not open %s for writing\n", optarg);
+                exit(1);
+            }
+            cancel_cleanup.push_back(optarg);
+            break;
+        case 's':
+            sidecar_name = optarg;
+            break;
+        case 'm':
+            merkle_name = optarg;
+            break;
+        case 'S':
+            serve_port = atoi(optarg);
+            if(serve_port <= 0 || serve_port > 65535) {
+                printf("Bad port %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'i':
+            in_place = true;
+            break;
+        case 't':
+            tar = true;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    cancel_setup(deadline);
+
+    bool tee = !copies.empty() || sidecar_name != NULL;
+    if(tee && (in_place || tar)) {
+        printf("-c and -s can't be combined with -i or -t\n");
+        exit(1);
+    }
+    if(!dropped.empty() && (tee || in_place || tar || serve_port != 0)) {
+        printf("--drop-track can only be used with a file to file run or -V\n");
+        exit(1);
+    }
+    if(layout.align_chunks && layout.align == 0) {
+        layout.align = 4096;
+    }
+    bool rewrite = !dropped.empty() || layout.align > 0 || layout.sidx || layout.mfra ||
+                   merkle_name != NULL || cache_dir != NULL;
+    if(merkle_name != NULL && (tee || in_place || tar || serve_port != 0 || verify)) {
+        printf("-m can only be used with a file to file run\n");
+        exit(1);
+    }
+    if(layout.align > 0 && (tee || in_place || tar || serve_port != 0 || verify)) {
+        printf("--align can only be used with a file to file run\n");
+        exit(1);
+    }
+    if((layout.sidx || layout.mfra) && (tee || in_place || tar || serve_port != 0 || verify)) {
+        printf("--sidx and --mfra can only be used with a file to file run\n");
+        exit(1);
+    }
+    if(cache_dir != NULL && (tee || in_place || tar || serve_port != 0 || verify || merkle_name != NULL)) {
+        printf("--cache can only be used with a file to file run, without -m\n");
+        exit(1);
+    }
+
+    if(verify) {
+        if(argc < 2) {
+            usage();
+            exit(1);
+        }
+        int problems = verify_output(argv[0], argv[1], dropped);
+        if(problems > 0) {
+            printf("%s: %d problems\n", argv[1], problems);
+            exit(1);
+        }
+        return 0;
+    }
+
+    if(serve_port != 0) {
+        if(argc < 1) {
+            usage();
+            exit(1);
+        }
+        return serve_http(serve_port, argv[0]);
+    }
+
+    if(in_place) {
+        if(argc < 1) {
+            usage();
+            exit(1);
+        }
+        return main_in_place(argv[0]);
+    }
    
     //Check inputs, open file, check for success
-    if(argc < 3) {
-        printf("Usage: m4mudex <infilename> <outfilename>");
+    if(argc < 2) {
+        usage();
         exit(1);
     } 
-    m4a_file = fopen(argv[1], "rb");
+    m4a_file = open_arg(argv[0], "rb");
     if (m4a_file == NULL) {
         printf("Provide the name of an existing m4a file to parse\n");
         exit(1);
     } 
+    source_t src = source_from_file(m4a_file);
+    sha256_t hash;
+
+    //Extra outputs are fed from the source as it's read, so the
+    //source has to be read once, front to back, like a pipe.
+    if(tee) {
+        src.seekable = false;
+        src.taps = &copies;
+        if(sidecar_name != NULL) {
+            sha256_init(&hash);
+            src.hash = &hash;
+        }
+    }
+
+    //Pipes can only be read once, so strip on the fly without
+    //building the whole tree. Keep stdout clean if it's the output.
+    if(tar || !src.seekable || strcmp(argv[1], "-") == 0) {
+        if(rewrite) {
+            fprintf(stderr, "--drop-track, --align, --sidx, --mfra, --cache and -m need a seekable input and output file\n");
+            exit(1);
+        }
+        out_file = open_arg(argv[1], "wb");
+        if (out_file == NULL) {
+            printf("Could not open %s for writing\n", argv[1]);
+            exit(1);
+        }
+        if(out_file != stdout) {
+            cancel_cleanup.push_back(argv[1]);
+        }
+        FILE *report = out_file == stdout ? stderr : stdout;
+        if(tar) {
+            if(strip_tar(m4a_file, out_file, report) != 0) {
+                exit(1);
+            }
+        } else {
+            uint64_t removed = strip_stream(&src, out_file, NULL, NULL);
+            fprintf(report, "Removed %llu bytes of meta boxes\n", (unsigned long long)removed);
+            for(size_t i = 0; i < copies.size(); i++) {
+                if(fclose(copies[i]) != 0 || src.tap_failed) {
+                    fprintf(report, "Could not write a copy of the input\n");
+                    exit(1);
+                }
+            }
+            if(sidecar_name != NULL &&
+               write_sidecar(sidecar_name, argv[0], src.pos, &hash, removed) != 0) {
+                fprintf(report, "Could not write %s\n", sidecar_name);
+                exit(1);
+            }
+        }
+        if(finish_output(out_file) != 0) {
+            fprintf(report, "Could not write %s\n", argv[1]);
+            exit(1);
+        }
+        fclose(out_file);
+        cancel_cleanup.clear();
+        return 0;
+    }
+
+    //A small file is read in one go, and handled in memory from here on
+    unsigned char *in_mem = NULL;
+    uint64_t out_size = 0;
+    if(src.limit <= small_file_max) {
+        in_mem = read_whole(fileno(m4a_file), src.limit);
+        src.mem = in_mem;
+    }
+
+    //An input that's been seen before is done with once it's hashed
+    char cache_key[65] = "";
+    if(cache_dir != NULL) {
+        unsigned char digest[32];
+        sha256_t input_hash;
+        sha256_init(&input_hash);
+        if(in_mem != NULL) {
+            sha256_update(&input_hash, in_mem, src.limit);
+        } else if(hash_fd(fileno(m4a_file), &input_hash) != 0) {
+            printf("Could not read %s\n", argv[0]);
+            exit(1);
+        }
+        sha256_final(&input_hash, digest);
+        make_cache_key(digest, output_options(dropped, &layout), cache_key);
+        if(cache_fetch(cache_dir, cache_key, argv[1]) == 0) {
+            printf("Found in the cache as %s\n", cache_key);
+            free(in_mem);
+            return 0;
+        }
+    }
 
     //Quick sanity check on input file
     printf("\nChecking to see if source file has a meta box: \n");
-    if((meta_idx = find_meta(m4a_file)) >= 0) {
+    bench_start();
+    if((meta_idx = in_mem != NULL ? find_meta_mem(in_mem, src.limit) : find_meta(m4a_file)) >= 0) {
         printf("Found a meta box at %d\n",meta_idx);
     } else {
         printf("No meta box found.\n");
     }
+    bench_end("find_meta", src.limit);
     rewind(m4a_file); 
 
     //Build the tree
-    atom_t* m4a_tree = build_tree(m4a_file);
+    bench_start();
+    atom_t* m4a_tree = build_tree(&src);
+    bench_end("build_tree", src.limit);
 
     //Show the tree
     printf("Original tree:\n");
     print_tree(m4a_tree);
     printf("\n");
     
-    //Get rid of metas and adjust offsets
-    strip_meta_box(m4a_tree);
+    //Get rid of metas and any tracks not wanted, and adjust offsets
+    bench_start();
+    std::vector<edit_t> edits;
+    if(!dropped.empty()) {
+        int count = drop_tracks(m4a_tree, dropped, edits);
+        if(count < 0) {
+            exit(1);
+        }
+        printf("Dropping %d tracks\n", count);
+    }
+    //The chunks are where they were in the input until the offsets
+    //are adjusted, and in the same order after.
+    std::vector<chunk_t> src_chunks, out_chunks;
+    if(merkle_name != NULL) {
+        get_all_chunks(m4a_tree, src_chunks);
+    }
+    if(strip_boxes(m4a_tree, edits, &layout) != 0) {
+        exit(1);
+    }
+    bench_end("strip", src.limit);
 
     //Show the modified tree
     printf("Modified tree:\n");
     print_tree(m4a_tree);
     printf("\n");
    
-    //Write out the modified tree. 
-    out_file = fopen(argv[2], "wb");
-    output_tree(m4a_tree, out_file);
+    //Write out the modified tree. With a cache, the output may be a
+    //hard link to a cached result, which mustn't be written through, so
+    //the new output is written under a name of its own and renamed over
+    //it.
+    bench_start();
+    std::string out_name = argv[1];
+    if(cache_dir != NULL) {
+        char tmp[32];
+        snprintf(tmp, sizeof(tmp), ".tmp.%d", (int)getpid());
+        out_name += tmp;
+    }
+    out_file = fopen(out_name.c_str(), "wb");
+    if (out_file == NULL) {
+        printf("Could not open %s for writing\n", out_name.c_str());
+        exit(1);
+    }
+    cancel_cleanup.push_back(out_name);
+    std::vector<merkle_leaf_t> leaves;
+    merkle_job_t merkle_job = { fileno(m4a_file), &leaves, 0, false };
+    pthread_t threads[8];
+    int thread_count = 0;
+    if(merkle_name != NULL) {
+        get_all_chunks(m4a_tree, out_chunks);
+        for(size_t i = 0; i < src_chunks.size() && i < out_chunks.size(); i++) {
+            merkle_leaf_t leaf = { src_chunks[i].offset, out_chunks[i].offset, src_chunks[i].size, {0} };
+            leaves.push_back(leaf);
+        }
+        std::sort(leaves.begin(), leaves.end(), leaf_before);
+        thread_count = merkle_start(&merkle_job, threads, 8);
+    }
+    if(in_mem != NULL) {
+        vfile_t vf;
+        vf.fd = -1;
+        vf.tree = m4a_tree;
+        vf.size = 0;
+        vfile_add_tree(&vf, m4a_tree);
+        out_size = vf.size;
+        if(vfile_writev(&vf, in_mem, fileno(out_file)) != 0) {
+            printf("Could not write %s\n", argv[1]);
+            exit(1);
+        }
+    } else {
+        output_tree(m4a_tree, out_file, &src);
+        if(finish_output(out_file) != 0) {
+            printf("Could not write %s\n", argv[1]);
+            exit(1);
+        }
+    }
     fclose(out_file); 
+    for(int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    check_cancel();
+    if(merkle_name != NULL &&
+       (__atomic_load_n(&merkle_job.failed, __ATOMIC_RELAXED) || write_merkle(merkle_name, argv[1], leaves) != 0)) {
+        printf("Could not write %s\n", merkle_name);
+        exit(1);
+    }
+    if(out_name != argv[1] && rename(out_name.c_str(), argv[1]) != 0) {
+        printf("Could not write %s: %s\n", argv[1], strerror(errno));
+        unlink(out_name.c_str());
+        exit(1);
+    }
+    cancel_cleanup.clear();
+    bench_end("output_tree", src.limit);
 
     //Verify the output file
     printf("\nVerifying that output file has no meta box: \n");
-    out_file = fopen(argv[2], "rb");
-    if((meta_idx = find_meta(out_file)) >= 0) {
+    bench_start();
+    out_file = fopen(argv[1], "rb");
+    unsigned char *out_mem = in_mem != NULL ? read_whole(fileno(out_file), out_size) : NULL;
+    if((meta_idx = out_mem != NULL ? find_meta_mem(out_mem, out_size) : find_meta(out_file)) >= 0) {
         printf("Found a meta box at %d\n",meta_idx);
     } else {
         printf("No meta box found.\n");
     }
+    bench_end("verify", src.limit);
+    free(out_mem);
+    free(in_mem);
+
+    if(cache_dir != NULL && cache_store(cache_dir, cache_key, argv[1]) != 0) {
+        printf("Could not add %s to the cache: %s\n", argv[1], strerror(errno));
+    }
     
 
 }
@@ -0,0 +1,619 @@
+/***
+ * Writes synthetic .m4a files for exercising m4mudex.
+ *
+ * The files are structurally complete (ftyp, moov with a full sample
+ * table for each track, and media data), but the media data is just a
+ * deterministic pseudo-random byte stream, so it won't play. What
+ * matters is that every chunk has distinct contents, so any mistake in
+ * moving the media data or adjusting chunk offsets shows up when the
+ * stripped file is compared with the original.
+ *
+ * The top-level layout is given as a comma-separated list of boxes:
+ *   ftyp  the file type box
+ *   moov  the movie box, with meta boxes in moov.udta and moov.trak
+ *   meta  a top-level meta box
+ *   free  padding
+ *   wide  a QuickTime placeholder for a 64-bit size (an empty box)
+ *   mdat  media data; the chunks are spread evenly over all the mdats
+ *
+ * Chunk offsets go in stco tables, or co64 tables with -6, and -L writes
+ * the mdat sizes in the 64-bit largesize field. -Z writes the size of
+ * the last mdat as 0, meaning it runs to the end of the file.
+ *
+ * -F makes a fragmented file: moov has empty sample tables and an mvex,
+ * and each chunk (SAMPLES_PER_CHUNK samples of every track) goes in a
+ * fragment of its own, a moof followed by an mdat, where the layout puts
+ * its mdat. The track fragment headers give absolute base data offsets,
+ * so they move along with everything else.
+ *
+ * -v adds an H.264 video track after the audio ones: an avc1 sample
+ * entry with an avcC holding one SPS and one PPS, and samples made of
+ * length-prefixed NAL units (an SEI and a slice, with random payloads),
+ * the first of each chunk a sync sample. With -H, the track is also
+ * written to a file as the Annex B stream export-es should make of it:
+ * a start code ahead of each NAL unit, and the SPS and PPS ahead of each
+ * sync sample.
+ *
+ * -Q makes a QuickTime movie instead: the meta boxes are QuickTime style
+ * (no version and flags, with keys and ilst), and moov.udta also has
+ * text atoms (a GPS position and a camera make) and ends with a 32-bit
+ * zero terminator, as QuickTime writes it.
+ */
+
+#include "stdio.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+typedef struct gen_track_t {
+    bool video;
+    std::vector<uint32_t> sample_sizes;
+    std::vector<uint64_t> chunk_offsets;
+} gen_track_t;
+
+#define SAMPLES_PER_CHUNK 10
+
+uint32_t rng_state = 12345;
+bool use_co64 = false;
+bool use_largesize = false;
+bool quicktime = false;
+bool fragmented = false;
+
+#define LOCATION "+37.7749-122.4194/"
+
+//The parameter sets of the video track; only their framing matters
+const std::string sps("\x67\x42\xc0\x1e\xd9\x00\xa0\x47\xfe\xc8", 10);
+const std::string pps("\x68\xce\x3c\x80", 4);
+
+uint32_t rng_next() {
+    rng_state = rng_state * 1103515245 + 12345;
+    return rng_state >> 8;
+}
+
+void put_be32(std::string &out, uint32_t v) {
+    out += (char)(v >> 24);
+    out += (char)(v >> 16);
+    out += (char)(v >> 8);
+    out += (char)v;
+}
+
+void put_be64(std::string &out, uint64_t v) {
+    put_be32(out, v >> 32);
+    put_be32(out, v);
+}
+
+void put_be16(std::string &out, uint16_t v) {
+    out += (char)(v >> 8);
+    out += (char)v;
+}
+
+std::string box(const char *name, const std::string &payload) {
+    std::string out;
+    put_be32(out, payload.size() + 8);
+    out += std::string(name, 4);
+    return out + payload;
+}
+
+//A FullBox: version and flags ahead of the payload
+std::string full_box(const char *name, const std::string &payload) {
+    return box(name, std::string(4, '\0') + payload);
+}
+
+//A QuickTime user data text atom: size, language and the text
+std::string text_atom(const char *name, const char *text) {
+    std::string p;
+    put_be16(p, strlen(text));
+    put_be16(p, 0x15c7);
+    return box(name, p + text);
+}
+
+std::string make_meta() {
+    if(quicktime) {
+        const char *key = "com.apple.quicktime.location.ISO6709";
+        std::string p;
+        put_be32(p, 1);
+        put_be32(p, 8 + strlen(key));
+        std::string keys = full_box("keys", p + "mdta" + key);
+        p.clear();
+        put_be32(p, 1);
+        put_be32(p, 0);
+        std::string item(4, '\0');
+        item[3] = 1;
+        std::string ilst = box("ilst", box(item.c_str(), box("data", p + LOCATION)));
+        std::string hdlr = full_box("hdlr", std::string(4, '\0') + "mdta" + std::string(13, '\0'));
+        return box("meta", hdlr + keys + ilst);
+    }
+    std::string hdlr = full_box("hdlr", std::string(4, '\0') + "mdir" + "appl" +
+                                std::string(9, '\0'));
+    std::string data = full_box("data", std::string("\0\0\0\0", 4) + "Synthetic title");
+    std::string ilst = box("ilst", box("\xa9nam", data));
+    return full_box("meta", hdlr + ilst);
+}
+
+std::string make_trak(int id, gen_track_t &track, bool with_meta) {
+    std::string p;
+    uint32_t i;
+
+    //tkhd: times, track id, duration, then layer/volume/matrix/size
+    p.clear();
+    put_be32(p, 0); put_be32(p, 0); put_be32(p, id); put_be32(p, 0);
+    put_be32(p, track.sample_sizes.size() * 1024);
+    p += std::string(8, '\0');
+    put_be16(p, 0); put_be16(p, 0); put_be16(p, 0x0100); put_be16(p, 0);
+    uint32_t matrix[9] = { 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000 };
+    for(i = 0; i < 9; i++) {
+        put_be32(p, matrix[i]);
+    }
+    put_be32(p, 0); put_be32(p, 0);
+    std::string tkhd = box("tkhd", std::string("\0\0\0\x07", 4) + p);
+
+    p.clear();
+    put_be32(p, 0); put_be32(p, 0); put_be32(p, 44100);
+    put_be32(p, track.sample_sizes.size() * 1024);
+    put_be16(p, 0x55c4); put_be16(p, 0);
+    std::string mdhd = full_box("mdhd", p);
+    std::string hdlr = full_box("hdlr", std::string(4, '\0') + (track.video ? "vide" : "soun") +
+                                std::string(12, '\0') + (track.video ? "VideoHandler" : "SoundHandler") +
+                                std::string(1, '\0'));
+    std::string smhd = track.video ? box("vmhd", std::string("\0\0\0\x01", 4) + std::string(8, '\0')) :
+                                     full_box("smhd", std::string(4, '\0'));
+    p.clear();
+    put_be32(p, 1);
+    std::string dinf = box("dinf", full_box("dref", p + box("url ", std::string("\0\0\0\x01", 4))));
+
+    //stsd with an mp4a sample entry and a minimal esds, or an avc1 one
+    p.clear();
+    p += std::string(6, '\0');
+    put_be16(p, 1);
+    p += std::string(8, '\0');
+    put_be16(p, 2); put_be16(p, 16); put_be16(p, 0); put_be16(p, 0);
+    put_be32(p, 44100 << 16);
+    std::string esds = full_box("esds", std::string("\x03\x19\0\x01\0\x04\x11\x40\x15\0\0\0"
+                                                    "\0\0\0\0\0\0\0\0\x05\x02\x12\x10\x06\x01\x02", 27));
+    std::string entry = box("mp4a", p + esds);
+    if(track.video) {
+        //avc1: the SampleEntry header, then 320x240 at 72 dpi, one frame
+        //a sample, no compressor name, 24-bit color
+        p.clear();
+        p += std::string(6, '\0');
+        put_be16(p, 1);
+        p += std::string(16, '\0');
+        put_be16(p, 320); put_be16(p, 240);
+        put_be32(p, 0x480000); put_be32(p, 0x480000);
+        put_be32(p, 0);
+        put_be16(p, 1);
+        p += std::string(32, '\0');
+        put_be16(p, 24); put_be16(p, 0xffff);
+        //avcC: Baseline, 4-byte NAL unit lengths, one SPS and one PPS
+        std::string avcc("\x01\x42\xc0\x1e\xff\xe1", 6);
+        put_be16(avcc, sps.size());
+        avcc += sps + "\x01";
+        put_be16(avcc, pps.size());
+        avcc += pps;
+        entry = box("avc1", p + box("avcC", avcc));
+    }
+    p.clear();
+    put_be32(p, 1);
+    std::string stsd = full_box("stsd", p + entry);
+
+    //In a fragmented file, the samples are all in the fragments
+    uint32_t samples = fragmented ? 0 : track.sample_sizes.size();
+    uint32_t chunks = fragmented ? 0 : track.chunk_offsets.size();
+    p.clear();
+    put_be32(p, samples > 0);
+    if(samples > 0) {
+        put_be32(p, samples); put_be32(p, 1024);
+    }
+    std::string stts = full_box("stts", p);
+    p.clear();
+    put_be32(p, samples > 0);
+    if(samples > 0) {
+        put_be32(p, 1); put_be32(p, SAMPLES_PER_CHUNK); put_be32(p, 1);
+    }
+    std::string stsc = full_box("stsc", p);
+    p.clear();
+    put_be32(p, 0); put_be32(p, samples);
+    for(i = 0; i < samples; i++) {
+        put_be32(p, track.sample_sizes[i]);
+    }
+    std::string stsz = full_box("stsz", p);
+    p.clear();
+    put_be32(p, samples / SAMPLES_PER_CHUNK);
+    for(i = 0; i < samples; i += SAMPLES_PER_CHUNK) {
+        put_be32(p, i + 1);
+    }
+    std::string stss = track.video ? full_box("stss", p) : std::string();
+    p.clear();
+    put_be32(p, chunks);
+    for(i = 0; i < chunks; i++) {
+        if(use_co64) {
+            put_be64(p, track.chunk_offsets[i]);
+        } else {
+            put_be32(p, track.chunk_offsets[i]);
+        }
+    }
+    std::string stco = full_box(use_co64 ? "co64" : "stco", p);
+
+    std::string stbl = box("stbl", stsd + stts + stss + stsc + stsz + stco);
+    std::string minf = box("minf", smhd + dinf + stbl);
+    std::string mdia = box("mdia", mdhd + hdlr + minf);
+    return box("trak", tkhd + mdia + (with_meta ? make_meta() : std::string()));
+}
+
+std::string make_moov(std::vector<gen_track_t> &tracks, bool with_meta) {
+    std::string p;
+    uint32_t i;
+    put_be32(p, 0); put_be32(p, 0); put_be32(p, 44100);
+    put_be32(p, tracks[0].sample_sizes.size() * 1024);
+    put_be32(p, 0x10000); put_be16(p, 0x100);
+    p += std::string(10, '\0');
+    uint32_t matrix[9] = { 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000 };
+    for(i = 0; i < 9; i++) {
+        put_be32(p, matrix[i]);
+    }
+    p += std::string(24, '\0');
+    put_be32(p, tracks.size() + 1);
+    std::string moov = full_box("mvhd", p);
+    for(i = 0; i < tracks.size(); i++) {
+        moov += make_trak(i + 1, tracks[i], with_meta);
+    }
+    if(fragmented) {
+        std::string trex;
+        for(i = 0; i < tracks.size(); i++) {
+            p.clear();
+            put_be32(p, i + 1); put_be32(p, 1); put_be32(p, 1024); put_be32(p, 0); put_be32(p, 0);
+            trex += full_box("trex", p);
+        }
+        moov += box("mvex", trex);
+    }
+    if(with_meta && quicktime) {
+        moov += box("udta", make_meta() + text_atom("\xa9xyz", LOCATION) +
+                    text_atom("\xa9mak", "Synthetic") + std::string(4, '\0'));
+    } else if(with_meta) {
+        moov += box("udta", make_meta());
+    }
+    return box("moov", moov);
+}
+
+//Write the contents of a sample. Audio samples are random bytes. A
+//video sample is two NAL units, an SEI and a slice, each with its
+//length ahead of it, and a random payload; they go to es as well, in
+//Annex B form, if it's open.
+void write_sample(FILE *out, FILE *es, const gen_track_t &track, uint32_t sample) {
+    uint32_t size = track.sample_sizes[sample];
+    std::string data;
+    uint32_t i;
+    if(!track.video) {
+        for(i = 0; i < size; i++) {
+            data += (char)rng_next();
+        }
+        fwrite(data.data(), 1, data.size(), out);
+        return;
+    }
+    bool sync = sample % SAMPLES_PER_CHUNK == 0;
+    uint32_t sei = (size - 8) / 3;
+    uint32_t lengths[2] = { sei, size - 8 - sei };
+    unsigned char types[2] = { 0x06, (unsigned char)(sync ? 0x65 : 0x41) };
+    if(es != NULL && sync) {
+        fwrite("\0\0\0\x01", 1, 4, es);
+        fwrite(sps.data(), 1, sps.size(), es);
+        fwrite("\0\0\0\x01", 1, 4, es);
+        fwrite(pps.data(), 1, pps.size(), es);
+    }
+    for(int n = 0; n < 2; n++) {
+        std::string nal(1, (char)types[n]);
+        for(i = 1; i < lengths[n]; i++) {
+            nal += (char)rng_next();
+        }
+        put_be32(data, nal.size());
+        data += nal;
+        if(es != NULL) {
+            fwrite("\0\0\0\x01", 1, 4, es);
+            fwrite(nal.data(), 1, nal.size(), es);
+        }
+    }
+    fwrite(data.data(), 1, data.size(), out);
+}
+
+//The fragment holding one chunk of every track, starting at offset: a
+//moof with a track fragment for each, and the mdat after it.
+std::string make_moof(std::vector<gen_track_t> &tracks, uint32_t chunk, uint64_t offset) {
+    std::string p, trafs;
+    uint32_t t, k;
+    uint64_t data = 0;
+    for(t = 0; t < tracks.size(); t++) {
+        //tfhd with the base data offset and the default sample duration
+        p.clear();
+        put_be32(p, t + 1); put_be64(p, offset); put_be32(p, 1024);
+        std::string tfhd = box("tfhd", std::string("\0\0\0\x09", 4) + p);
+        p.clear();
+        put_be64(p, (uint64_t)chunk * SAMPLES_PER_CHUNK * 1024);
+        std::string tfdt = box("tfdt", std::string("\x01\0\0\0", 4) + p);
+        //trun with the data offset (filled in below) and sample sizes
+        p.clear();
+        put_be32(p, SAMPLES_PER_CHUNK); put_be32(p, 0);
+        for(k = 0; k < SAMPLES_PER_CHUNK; k++) {
+            put_be32(p, tracks[t].sample_sizes[chunk * SAMPLES_PER_CHUNK + k]);
+            data += tracks[t].sample_sizes[chunk * SAMPLES_PER_CHUNK + k];
+        }
+        std::string trun = box("trun", std::string("\0\0\x02\x01", 4) + p);
+        trafs += box("traf", tfhd + tfdt + trun);
+    }
+    p.clear();
+    put_be32(p, chunk + 1);
+    std::string moof = box("moof", full_box("mfhd", p) + trafs);
+
+    //Each trun's data offset is from the start of the moof
+    size_t at = 0;
+    uint64_t pos = moof.size() + (use_largesize ? 16 : 8);
+    for(t = 0; t < tracks.size(); t++) {
+        at = moof.find("trun", at) + 4 + 8;
+        for(k = 0; k < 4; k++) {
+            moof[at + k] = (char)(pos >> (24 - 8 * k));
+        }
+        for(k = 0; k < SAMPLES_PER_CHUNK; k++) {
+            pos += tracks[t].sample_sizes[chunk * SAMPLES_PER_CHUNK + k];
+        }
+    }
+    p.clear();
+    if(use_largesize) {
+        put_be32(p, 1);
+        p += "mdat";
+        put_be64(p, data + 16);
+    } else {
+        put_be32(p, data + 8);
+        p += "mdat";
+    }
+    return moof + p;
+}
+
+void usage() {
+    printf("Usage: m4mugen [-l layout] [-n samples] [-t tracks] [-M6LZQFv] [-H esfile] <outfilename>\n");
+    printf("\n");
+    printf("  -l  comma-separated top-level boxes (default ftyp,moov,free,mdat)\n");
+    printf("  -n  samples per track (default 1000)\n");
+    printf("  -t  number of audio tracks (default 1)\n");
+    printf("  -M  leave the meta boxes out of moov\n");
+    printf("  -6  use co64 chunk offset tables\n");
+    printf("  -L  write mdat sizes as 64-bit largesize\n");
+    printf("  -Z  write the last mdat's size as 0 (to the end of the file)\n");
+    printf("  -Q  write a QuickTime movie\n");
+    printf("  -F  write a fragmented file, with a fragment for each chunk\n");
+    printf("  -v  add an H.264 video track\n");
+    printf("  -H  write the video track's Annex B stream to esfile\n");
+}
+
+int main(int argc, char** argv) {
+    std::string layout = "ftyp,moov,free,mdat";
+    uint32_t samples = 1000;
+    uint32_t track_count = 1;
+    bool moov_meta = true;
+    bool size_to_end = false;
+    bool video = false;
+    const char *es_name = NULL;
+    uint32_t i, t;
+    int opt;
+
+    while((opt = getopt(argc, argv, "l:n:t:M6LZQFvH:")) != -1) {
+        switch(opt) {
+        case 'l':
+            layout = optarg;
+            break;
+        case 'n':
+            samples = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            track_count = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            moov_meta = false;
+            break;
+        case '6':
+            use_co64 = true;
+            break;
+        case 'L':
+            use_largesize = true;
+            break;
+        case 'Z':
+            size_to_end = true;
+            break;
+        case 'Q':
+            quicktime = true;
+            break;
+        case 'F':
+            fragmented = true;
+            break;
+        case 'v':
+            video = true;
+            break;
+        case 'H':
+            es_name = optarg;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if(optind >= argc || samples < SAMPLES_PER_CHUNK || track_count < 1) {
+        usage();
+        exit(1);
+    }
+    if(size_to_end && use_largesize) {
+        printf("-Z and -L can't be combined\n");
+        exit(1);
+    }
+    if(fragmented && (size_to_end || quicktime)) {
+        printf("-F can't be combined with -Z or -Q\n");
+        exit(1);
+    }
+    if(fragmented && video) {
+        printf("-F can't be combined with -v\n");
+        exit(1);
+    }
+    if(es_name != NULL && !video) {
+        printf("-H needs -v\n");
+        exit(1);
+    }
+
+    std::vector<std::string> boxes;
+    size_t start = 0;
+    while(start <= layout.size()) {
+        size_t end = layout.find(',', start);
+        if(end == std::string::npos) {
+            end = layout.size();
+        }
+        boxes.push_back(layout.substr(start, end - start));
+        start = end + 1;
+    }
+    uint32_t mdat_count = 0;
+    for(i = 0; i < boxes.size(); i++) {
+        if(boxes[i] == "mdat") {
+            mdat_count++;
+        }
+    }
+    if(mdat_count == 0) {
+        printf("The layout needs at least one mdat\n");
+        exit(1);
+    }
+    if(size_to_end && boxes.back() != "mdat") {
+        printf("-Z needs the layout to end with an mdat\n");
+        exit(1);
+    }
+
+    std::vector<gen_track_t> tracks(track_count + (video ? 1 : 0));
+    for(t = 0; t < tracks.size(); t++) {
+        tracks[t].video = t == track_count;
+        for(i = 0; i < samples - samples % SAMPLES_PER_CHUNK; i++) {
+            tracks[t].sample_sizes.push_back(100 + rng_next() % 400);
+        }
+        tracks[t].chunk_offsets.resize(tracks[t].sample_sizes.size() / SAMPLES_PER_CHUNK);
+    }
+    uint32_t chunk_count = tracks[0].chunk_offsets.size();
+
+    //The moov size doesn't depend on the offsets, so lay the file out
+    //with placeholder offsets first, then fill them in.
+    uint64_t moov_size = make_moov(tracks, moov_meta).size();
+    uint64_t pos = 0;
+    uint32_t mdat_index = 0;
+    uint32_t chunk = 0;
+    std::vector<uint64_t> mdat_sizes;
+    std::vector<uint64_t> fragment_offsets(chunk_count);
+    for(i = 0; i < boxes.size(); i++) {
+        if(boxes[i] == "ftyp") {
+            pos += 32;
+        } else if(boxes[i] == "moov") {
+            pos += moov_size;
+        } else if(boxes[i] == "meta") {
+            pos += make_meta().size();
+        } else if(boxes[i] == "free") {
+            pos += 1024;
+        } else if(boxes[i] == "wide") {
+            pos += 8;
+        } else if(boxes[i] == "mdat" && fragmented) {
+            uint32_t last = chunk_count * (mdat_index + 1) / mdat_count;
+            for(; chunk < last; chunk++) {
+                fragment_offsets[chunk] = pos;
+                pos += make_moof(tracks, chunk, pos).size();
+                for(t = 0; t < tracks.size(); t++) {
+                    for(uint32_t k = 0; k < SAMPLES_PER_CHUNK; k++) {
+                        pos += tracks[t].sample_sizes[chunk * SAMPLES_PER_CHUNK + k];
+                    }
+                }
+            }
+            mdat_index++;
+        } else if(boxes[i] == "mdat") {
+            //Chunks of the tracks are interleaved within each mdat
+            uint32_t last = chunk_count * (mdat_index + 1) / mdat_count;
+            uint64_t mdat_start = pos;
+            pos += use_largesize ? 16 : 8;
+            for(; chunk < last; chunk++) {
+                for(t = 0; t < tracks.size(); t++) {
+                    tracks[t].chunk_offsets[chunk] = pos;
+                    for(uint32_t k = 0; k < SAMPLES_PER_CHUNK; k++) {
+                        pos += tracks[t].sample_sizes[chunk * SAMPLES_PER_CHUNK + k];
+                    }
+                }
+            }
+            mdat_sizes.push_back(pos - mdat_start);
+            mdat_index++;
+        } else {
+            printf("Unknown box in layout: %s\n", boxes[i].c_str());
+            exit(1);
+        }
+    }
+
+    FILE *out_file = fopen(argv[optind], "wb");
+    if(out_file == NULL) {
+        printf("Could not open %s for writing\n", argv[optind]);
+        exit(1);
+    }
+    FILE *es_file = NULL;
+    if(es_name != NULL) {
+        es_file = fopen(es_name, "wb");
+        if(es_file == NULL) {
+            printf("Could not open %s for writing\n", es_name);
+            exit(1);
+        }
+    }
+    mdat_index = 0;
+    chunk = 0;
+    for(i = 0; i < boxes.size(); i++) {
+        std::string out;
+        if(boxes[i] == "mdat" && fragmented) {
+            uint32_t last = chunk_count * (++mdat_index) / mdat_count;
+            for(; chunk < last; chunk++) {
+                out = make_moof(tracks, chunk, fragment_offsets[chunk]);
+                fwrite(out.data(), 1, out.size(), out_file);
+                for(t = 0; t < tracks.size(); t++) {
+                    for(uint32_t k = 0; k < SAMPLES_PER_CHUNK; k++) {
+                        write_sample(out_file, es_file, tracks[t], chunk * SAMPLES_PER_CHUNK + k);
+                    }
+                }
+            }
+            continue;
+        }
+        if(boxes[i] == "ftyp" && quicktime) {
+            out = box("ftyp", std::string("qt  \0\0\0\0qt  \0\0\0\0\0\0\0\0\0\0\0\0", 24));
+        } else if(boxes[i] == "ftyp") {
+            out = box("ftyp", std::string("M4A \0\0\0\0M4A mp42isom\0\0\0\0", 24));
+        } else if(boxes[i] == "moov") {
+            out = make_moov(tracks, moov_meta);
+        } else if(boxes[i] == "meta") {
+            out = make_meta();
+        } else if(boxes[i] == "free") {
+            out = box("free", std::string(1016, '\0'));
+        } else if(boxes[i] == "wide") {
+            out = box("wide", std::string());
+        } else if(size_to_end && mdat_index + 1 == mdat_sizes.size()) {
+            put_be32(out, 0);
+            out += "mdat";
+            mdat_index++;
+        } else if(use_largesize) {
+            put_be32(out, 1);
+            out += "mdat";
+            put_be64(out, mdat_sizes[mdat_index++]);
+        } else {
+            put_be32(out, mdat_sizes[mdat_index++]);
+            out += "mdat";
+        }
+        fwrite(out.data(), 1, out.size(), out_file);
+        if(boxes[i] == "mdat") {
+            uint32_t last = chunk_count * mdat_index / mdat_count;
+            for(; chunk < last; chunk++) {
+                for(t = 0; t < tracks.size(); t++) {
+                    for(uint32_t k = 0; k < SAMPLES_PER_CHUNK; k++) {
+                        write_sample(out_file, es_file, tracks[t], chunk * SAMPLES_PER_CHUNK + k);
+                    }
+                }
+            }
+        }
+    }
+    fclose(out_file);
+    if(es_file != NULL) {
+        fclose(es_file);
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+#!/bin/sh
+# Compares how fast m4mudex runs, and how much memory it uses, against
+# the baseline in perf-baseline.txt, phase by phase (the phases are the
+# ones m4mudex -B reports). Each corpus file is run a few times and the
+# best time and lowest peak RSS of each phase are kept.
+#
+# A phase regresses if it takes longer than the baseline time by more
+# than TIME_TOLERANCE (a fraction, plus a few milliseconds of slack for
+# phases too short to time reliably), or if its peak RSS exceeds the
+# baseline by more than RSS_TOLERANCE. Regressions make this exit 1.
+#
+# Run with --update to write the current numbers as the new baseline.
+
+M=./m4mudex
+G=./m4mugen
+DIR=perf.tmp
+BASELINE=perf-baseline.txt
+RUNS=${RUNS:-3}
+TIME_TOLERANCE=${TIME_TOLERANCE:-0.40}
+RSS_TOLERANCE=${RSS_TOLERANCE:-0.25}
+
+rm -rf $DIR
+mkdir -p $DIR
+
+# The corpus: name, then m4mugen arguments. Changing it invalidates
+# the baseline. "small" (about 6 MB) is under SMALL_FILE_MAX, so it
+# takes the in-memory path most of the catalog does; the others are
+# well over it.
+corpus="large:-t 2 -n 150000
+interleaved:-l ftyp,moov,free,mdat,mdat,mdat,mdat -t 4 -n 40000
+small:-t 2 -n 10000"
+
+echo "$corpus" | while IFS=: read name args; do
+    $G $args $DIR/$name.m4a || exit 1
+    i=0
+    while [ $i -lt $RUNS ]; do
+        $M -B $DIR/$name.m4a $DIR/$name.out 2>&1 > /dev/null |
+            awk -v name=$name '$1 == "bench" { print name, $2, $3, $4, $5 }'
+        i=$((i + 1))
+    done
+done > $DIR/runs.txt || exit 1
+
+# Best of the runs for each corpus file and phase
+awk '{
+    key = $1 " " $2
+    if(!(key in secs)) { order[n++] = key; secs[key] = $3; rate[key] = $4; rss[key] = $5 }
+    if($3 < secs[key]) { secs[key] = $3; rate[key] = $4 }
+    if($5 < rss[key]) { rss[key] = $5 }
+} END {
+    for(i = 0; i < n; i++) print order[i], secs[order[i]], rate[order[i]], rss[order[i]]
+}' $DIR/runs.txt > $DIR/current.txt
+
+if [ "$1" = "--update" ]; then
+    {
+        echo "# corpus phase seconds MB/s peak_rss_kb"
+        echo "# Written by perf-check.sh --update; see perf-check.sh for the corpus."
+        cat $DIR/current.txt
+    } > $BASELINE
+    cat $BASELINE
+    rm -rf $DIR
+    exit 0
+fi
+
+awk -v time_tol=$TIME_TOLERANCE -v rss_tol=$RSS_TOLERANCE '
+FNR == NR {
+    if($1 !~ /^#/) { base[$1 " " $2] = $0 }
+    next
+}
+{
+    key = $1 " " $2
+    if(!(key in base)) {
+        printf "%-12s %-12s %10s  %8.1f MB/s %8d KB   new phase, no baseline\n", $1, $2, "", $4, $5
+        next
+    }
+    split(base[key], b, " ")
+    status = "ok"
+    if($3 > b[3] * (1 + time_tol) + 0.005) { status = "SLOWER"; bad++ }
+    if($5 > b[5] * (1 + rss_tol)) { status = (status == "ok" ? "" : status "+") "MORE MEMORY"; bad++ }
+    printf "%-12s %-12s %8.1f -> %8.1f MB/s %8d -> %8d KB   %s\n", $1, $2, b[4], $4, b[5], $5, status
+}
+END { exit bad > 0 }' $BASELINE $DIR/current.txt
+status=$?
+rm -rf $DIR
+if [ $status -ne 0 ]; then
+    echo "Performance regressed against $BASELINE"
+fi
+exit $status